@@ -0,0 +1,603 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2020 NKI/AVL, Netherlands Cancer Institute
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+// Internal header, the tables with the Ramachandran and torsion statistics
+// and the routines used to store them.
+
+#include "tortoize.hpp"
+#include "dihedrals.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <string>
+#include <tuple>
+#include <variant>
+#include <vector>
+
+// --------------------------------------------------------------------
+// simple integer compression, based somewhat on MRS code
+
+class OBitStream
+{
+  public:
+	OBitStream(std::vector<uint8_t> &buffer)
+		: m_buffer(buffer)
+	{
+		m_buffer.push_back(0);
+	}
+
+	OBitStream(const OBitStream &) = delete;
+	OBitStream &operator=(const OBitStream &) = delete;
+
+	void writebit(bool bit)
+	{
+		if (bit)
+			m_buffer.back() |= 1 << m_bitOffset;
+
+		if (--m_bitOffset < 0)
+		{
+			m_buffer.push_back(0);
+			m_bitOffset = 7;
+		}
+	}
+
+	// write fixed size
+	void write(uint32_t value, int bits)
+	{
+		while (bits-- > 0)
+		{
+			if (value & (1UL << bits))
+				m_buffer.back() |= 1 << m_bitOffset;
+
+			if (--m_bitOffset < 0)
+			{
+				m_buffer.push_back(0);
+				m_bitOffset = 7;
+			}
+		}
+	}
+
+	void sync()
+	{
+		writebit(0);
+
+		while (m_bitOffset != 7)
+			writebit(1);
+	}
+
+	const uint8_t *data() const { return m_buffer.data(); }
+	size_t size() const { return m_buffer.size(); }
+
+	friend void WriteArray(OBitStream &bs, const std::vector<uint32_t> &data);
+
+  private:
+	std::vector<uint8_t> &m_buffer;
+	int m_bitOffset = 7;
+};
+
+class IBitStream
+{
+  public:
+	IBitStream(const uint8_t *data)
+		: m_data(data)
+		, m_byte(*m_data++)
+		, m_bitOffset(7)
+	{
+	}
+
+	IBitStream(const OBitStream &bits)
+		: IBitStream(bits.data())
+	{
+	}
+
+	IBitStream(const IBitStream &) = delete;
+	IBitStream &operator=(const IBitStream &) = delete;
+
+	uint32_t read(int bc)
+	{
+		uint32_t result = 0;
+
+		while (bc > 0)
+		{
+			static const uint8_t kM[] = { 0x00, 0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F, 0xFF };
+
+			int bw = m_bitOffset + 1;
+			if (bw > bc)
+				bw = bc;
+
+			m_bitOffset -= bw;
+			result = result << bw | (kM[bw] & (m_byte >> (m_bitOffset + 1)));
+
+			if (m_bitOffset < 0)
+			{
+				m_byte = *m_data++;
+				m_bitOffset = 7;
+			}
+
+			bc -= bw;
+		}
+
+		return result;
+	}
+
+	friend std::vector<uint32_t> ReadArray(IBitStream &bs);
+
+  private:
+	const uint8_t *m_data;
+	uint8_t m_byte;
+	int m_bitOffset;
+};
+
+// --------------------------------------------------------------------
+//    Arrays
+//    This is a simplified version of the array compression routines in MRS
+//    Only supported datatype is uint32_t and only supported width it 24 bit.
+
+void CompressSimpleArraySelector(OBitStream &inBits, const std::vector<uint32_t> &inArray);
+void DecompressSimpleArraySelector(IBitStream &inBits, std::vector<uint32_t> &outArray);
+
+// --------------------------------------------------------------------
+// The header for the data blocks as written in de resource
+
+struct StoredData
+{
+	char aa[3];
+	SecStrType ss;
+	float mean, mean_vs_random, sd, sd_vs_random, binSpacing;
+	uint32_t offset; // offset into compressed data area
+};
+
+// --------------------------------------------------------------------
+/// A periodic grid of counts over one (\a D is 1) or two (\a D is 2)
+/// angles. The number of dimensions is known at compile time, the
+/// interpolation has no branches on it. Integer types \a T hold the
+/// counts quantized with a scale and offset, for integer counts that fit
+/// in \a T the scale is 1 and the offset 0 so the counts are exact.
+
+template <size_t D, typename T = uint16_t>
+class Grid
+{
+  public:
+	static_assert(D == 1 or D == 2, "Only one and two dimensional grids are supported");
+
+	Grid() = default;
+
+	/// A grid of \a dim points per dimension containing \a values, in row
+	/// major order
+	Grid(size_t dim, const std::vector<float> &values);
+
+	size_t dim() const { return m_dim; }
+	size_t size() const { return m_values.size(); }
+
+	/// The count at grid point \a i, in row major order
+	float operator[](size_t i) const
+	{
+		return m_offset + m_scale * m_values[i];
+	}
+
+	/// The count at grid point \a a1Ix, \a a2Ix, the indices wrap
+	float count(size_t a1Ix, size_t a2Ix = 0) const
+	{
+		if constexpr (D == 2)
+			return m_offset + m_scale * m_values[(a1Ix % m_dim) * m_dim + a2Ix % m_dim];
+		else
+			return m_offset + m_scale * m_values[a1Ix % m_dim];
+	}
+
+	/// The bilinear interpolated count, \a a2 is ignored for a one
+	/// dimensional grid
+	float interpolatedCount(float a1, float a2) const;
+
+	/// The interpolated count and its derivatives to a1 and a2, per degree
+	std::tuple<float, float, float> interpolatedCountAndGradient(float a1, float a2, Interpolation interpolation) const;
+
+	/// A grid of \a dim points per dimension sampled from the bicubic
+	/// interpolation of this grid
+	Grid resample(size_t dim) const;
+
+  private:
+	std::vector<T> m_values;
+	float m_scale = 1, m_offset = 0;
+	size_t m_dim = 0;
+};
+
+// --------------------------------------------------------------------
+/// A table resolved for scoring, a grid of known type with the mean and sd
+/// of the table. The grid type is resolved once, when the table is looked
+/// up, the scoring itself does not inspect it.
+
+template <size_t D>
+struct ScoringTable
+{
+	const Grid<D> *grid = nullptr;
+	float mean = 0, sd = 1;
+
+	explicit operator bool() const { return grid != nullptr; }
+
+	float zscore(float a1, float a2) const
+	{
+		return (grid->interpolatedCount(a1, a2) - mean) / sd;
+	}
+
+	ZScoreGradient zscore(float a1, float a2, Interpolation interpolation) const
+	{
+		auto [c, d1, d2] = grid->interpolatedCountAndGradient(a1, a2, interpolation);
+		return { (c - mean) / sd, d1 / sd, d2 / sd };
+	}
+};
+
+// --------------------------------------------------------------------
+/// The mean and sd of a table are those of the count of the bin of each
+/// observation. Since the counts are the binned observations, these follow
+/// from the \a counts alone: each bin contributes its count, weighted by
+/// that same count. The sd is the sample standard deviation. Returns the
+/// number of observations, the mean and the sd.
+
+template <typename Counts>
+std::tuple<double, double, double> binCountStatistics(const Counts &counts)
+{
+	double n = 0, sum = 0, sumSq = 0;
+
+	for (size_t i = 0; i < counts.size(); ++i)
+	{
+		double c = counts[i];
+		n += c;
+		sum += c * c;
+		sumSq += c * c * c;
+	}
+
+	if (n == 0)
+		return { 0, 0, 1 };
+
+	double mean = sum / n;
+	double sd = n > 1 ? std::sqrt(std::max((sumSq - n * mean * mean) / (n - 1), 0.0)) : 0;
+
+	return { n, mean, sd };
+}
+
+// --------------------------------------------------------------------
+
+class Data
+{
+	friend class DataTable;
+	friend class TableTrainer;
+
+  public:
+	Data(Data &&d)
+		: aa(d.aa)
+		, ss(d.ss)
+		, mean(d.mean)
+		, sd(d.sd)
+		, mean_vs_random(d.mean_vs_random)
+		, sd_vs_random(d.sd_vs_random)
+		, binSpacing(d.binSpacing)
+		, counts(move(d.counts))
+		, grid(move(d.grid))
+		, dim(d.dim)
+	{
+	}
+
+	Data(const Data &) = delete;
+	Data &operator=(const Data &) = delete;
+
+	Data(const char *type, const std::string &aa, SecStrType ss, std::istream &is);
+	Data(bool torsion, const StoredData &data, const uint8_t *bits);
+
+	/// An empty table, all counts are zero
+	Data(bool torsion, const std::string &aa, SecStrType ss, float binSpacing);
+
+	void store(StoredData &data, std::vector<uint8_t> &databits) const;
+
+	/// Replace the grid by one with \a binSpacing, sampled from the bicubic
+	/// interpolation of the current grid. Does nothing if the grid already
+	/// has this spacing, throws std::invalid_argument if \a binSpacing is
+	/// coarser. The counts are released, a resampled table cannot be stored.
+	void resample(float binSpacing);
+
+	/// The table resolved for a grid of \a D dimensions. Empty when the
+	/// grid of this table has the other number of dimensions.
+	template <size_t D>
+	ScoringTable<D> scoringTable() const
+	{
+		return { std::get_if<Grid<D>>(&grid), mean, sd };
+	}
+
+	bool twoDimensional() const
+	{
+		return std::holds_alternative<Grid<2>>(grid);
+	}
+
+	/// The z-score for a single pair of angles. The grid type is selected
+	/// on each call, scoring residues uses scoringTable instead.
+	float zscore(float a1, float a2) const
+	{
+		return std::visit([this, a1, a2](auto &g)
+			{ return (g.interpolatedCount(a1, a2) - mean) / sd; },
+			grid);
+	}
+
+	ZScoreGradient zscore(float a1, float a2, Interpolation interpolation) const
+	{
+		return std::visit([this, a1, a2, interpolation](auto &g)
+			{
+			auto [c, d1, d2] = g.interpolatedCountAndGradient(a1, a2, interpolation);
+			return ZScoreGradient{ (c - mean) / sd, d1 / sd, d2 / sd }; },
+			grid);
+	}
+
+	/// The stored mean and sd, see binCountStatistics
+	std::tuple<float, float> meanAndSD() const
+	{
+		return { mean, sd };
+	}
+
+	/// The number of observations, the mean and sd recalculated from the
+	/// counts of the grid
+	std::tuple<double, double, double> statistics() const
+	{
+		return std::visit([](auto &g)
+			{ return binCountStatistics(g); },
+			grid);
+	}
+
+	void dump() const
+	{
+		std::visit([this](auto &g)
+			{
+			for (size_t i = 0; i < g.size(); ++i)
+			{
+				float a1, a2;
+				std::tie(a1, a2) = angles(i);
+				std::cout << a1 << ' ' << a2 << ' ' << g[i] << std::endl;
+			} },
+			grid);
+	}
+
+  private:
+	std::string aa;
+	SecStrType ss;
+	float mean, sd, mean_vs_random, sd_vs_random;
+	float binSpacing;
+
+	// The counts as read or trained, only kept when the table is to be
+	// stored. Scoring uses the grid.
+	std::vector<uint32_t> counts;
+	std::variant<Grid<1>, Grid<2>> grid;
+
+	// calculated
+	size_t dim;
+
+	/// The two dimensional tables, all but the torsion tables of the
+	/// residues with a single chi angle
+	static bool isTwoDimensional(bool torsion, const std::string &aa)
+	{
+		return not torsion or (aa != "CYS" and aa != "SER" and aa != "THR" and aa != "VAL");
+	}
+
+	/// Create the grid from the counts, a two dimensional grid if
+	/// \a twoDimensional is true
+	void quantize(bool twoDimensional);
+
+	size_t index(bool twoDimensional, float a1, float a2 = 0) const
+	{
+		size_t x = 0, y = 0;
+
+		if (twoDimensional)
+		{
+			x = static_cast<size_t>((a1 + 180) / binSpacing);
+			y = static_cast<size_t>((a2 + 180) / binSpacing);
+		}
+		else
+			y = static_cast<size_t>((a1 + 180) / binSpacing);
+
+		return x * static_cast<int>(std::rint(360 / binSpacing)) + y;
+	}
+
+	std::tuple<float, float> angles(size_t index) const
+	{
+		size_t x = index / dim;
+		size_t y = index % dim;
+
+		return std::make_tuple(x * binSpacing - 180, y * binSpacing - 180);
+	}
+};
+
+// --------------------------------------------------------------------
+
+class DataTable
+{
+  public:
+	/// The default instance, loaded on first use. This is the table
+	/// returned by defaultDataTable().
+	static const DataTable &instance()
+	{
+		return *defaultDataTable();
+	}
+
+	/// Load the tables from the resources. The tables are not modified
+	/// after construction. If \a binSpacing is not zero, the grids are
+	/// resampled to \a binSpacing degrees, see loadDataTable.
+	explicit DataTable(float binSpacing = 0);
+
+	/// Load the tables from rama-data.bin and torsion-data.bin in \a dir,
+	/// e.g. tables written by trainDataFiles
+	explicit DataTable(const std::filesystem::path &dir, float binSpacing = 0);
+
+	const Data &loadTorsionData(const std::string &aa, SecStrType ss) const;
+	const Data &loadRamachandranData(const std::string &aa, SecStrType ss) const;
+
+	float mean_torsion() const { return m_mean_torsion; }
+	float sd_torsion() const { return m_sd_torsion; }
+	float mean_ramachandran() const { return m_mean_ramachandran; }
+	float sd_ramachandran() const { return m_sd_ramachandran; }
+
+  private:
+	DataTable(const DataTable &) = delete;
+	DataTable &operator=(const DataTable &) = delete;
+
+	void load(const char *name, std::istream &is, std::vector<Data> &table, float &mean, float &sd);
+	void resample(float binSpacing);
+
+	std::vector<Data> m_torsion, m_ramachandran;
+
+	float m_mean_torsion, m_sd_torsion, m_mean_ramachandran, m_sd_ramachandran;
+};
+
+/// Write \a tables with the global \a mean and \a sd to \a file, in the
+/// format read by DataTable
+void writeDataFile(const std::filesystem::path &file, float mean, float sd, const std::vector<Data> &tables);
+
+// --------------------------------------------------------------------
+
+float jackknife(const std::vector<float> &zScorePerResidue, float mean, float sd);
+
+/// The same jackknife estimate, calculated from the sum and the sum of
+/// squares of the \a n z-scores
+float jackknife(double sum, double sumSq, size_t n, float sd);
+
+/// Running sums of the z-scores of a group of residues
+struct GroupSums
+{
+	double ramaSum = 0, ramaSumSq = 0, torsSum = 0, torsSumSq = 0;
+	size_t ramaCount = 0, torsCount = 0;
+
+	/// Add the z-scores of \a score, or subtract them when \a sign is -1
+	void add(const ResidueScore &score, int sign = 1);
+	GroupScore score(const DataTable &tbl) const;
+
+	bool empty() const { return ramaCount == 0 and torsCount == 0; }
+};
+
+/// Running sums per chain and per entity
+struct GroupedSums
+{
+	std::map<std::string, GroupSums> chains, entities;
+
+	void add(const std::string &asymID, const std::string &entityID, const ResidueScore &score, int sign = 1)
+	{
+		chains[asymID].add(score, sign);
+		entities[entityID].add(score, sign);
+	}
+
+	void store(ModelScore &result, const DataTable &tbl) const;
+};
+
+/// The sums over the residues of a model, for the model, chain and entity
+/// scores. Shared by the scoring paths that score a model at once.
+struct ModelSums
+{
+	std::vector<float> rama, torsion;
+	double ramaSum = 0, torsSum = 0;
+	GroupedSums groups;
+
+	void add(const std::string &asymID, const std::string &entityID, const ResidueScore &score);
+
+	/// Store the model, chain and entity scores in \a result, the scores
+	/// not calculated according to \a only are NaN
+	void store(ModelScore &result, const DataTable &tbl, ScoreType only) const;
+};
+
+/// The dihedral angles needed for \a only
+inline PolymerDihedrals::Angles dihedralAngles(ScoreType only)
+{
+	switch (only)
+	{
+		case ScoreType::ramachandran: return PolymerDihedrals::Omega;
+		case ScoreType::torsion: return PolymerDihedrals::Chi;
+		default: return PolymerDihedrals::AllAngles;
+	}
+}
+
+/// A copy of \a db with only the polymer atoms of the residues in
+/// \a selection and the residues needed to calculate their angles and
+/// secondary structure. All non-polymer atoms are kept.
+cif::datablock selectResidues(const cif::datablock &db, const Selection &selection, int verbose);
+
+/// Fill in the local z-scores of \a residues for each of \a windows. The
+/// residues of a chain should be consecutive and in sequence order.
+void calculateLocalZScores(std::vector<ResidueScore> &residues, const std::vector<size_t> &windows, const DataTable &tbl);
+
+/// The compound ID of the statistics to use for \a compoundID, common
+/// modified amino acids are mapped to their parent, anything else unknown
+/// to ALA.
+std::string remapCompoundID(std::string compoundID, int verbose);
+
+/// How a residue is classified to select the statistics
+struct ResidueClass
+{
+	std::string aa; ///< The remapped compound ID
+	SecStrType ramachandranSS, torsionSS;
+};
+
+/// Classify residue \a i in \a poly, nothing is returned for residues that
+/// are not scored. Used for both the scoring and the training.
+std::optional<ResidueClass> classifyResidue(const cif::mm::polymer &poly, size_t i, const PolymerDihedrals &dihedrals,
+	const SecStrAssignment &secstr, int verbose);
+
+/// The same, using the secondary structure \a ss of the residue
+std::optional<ResidueClass> classifyResidue(const cif::mm::polymer &poly, size_t i, const PolymerDihedrals &dihedrals,
+	std::optional<SecStrType> ss, int verbose);
+
+/// Score residue \a i in \a poly, nothing is returned for residues that
+/// cannot be scored. The identifying fields are left empty when
+/// options.summaryOnly is set.
+std::optional<ResidueScore> scoreResidue(const cif::mm::polymer &poly, size_t i, const PolymerDihedrals &dihedrals,
+	const SecStrAssignment &secstr, const DataTable &tbl, const TortoizeOptions &options);
+
+/// The same, using the secondary structure \a ss of the residue
+std::optional<ResidueScore> scoreResidue(const cif::mm::polymer &poly, size_t i, const PolymerDihedrals &dihedrals,
+	std::optional<SecStrType> ss, const DataTable &tbl, const TortoizeOptions &options);
+
+/// The statistics for a classified residue, resolved for scoring. The
+/// ramachandran table is required unless options.only is torsion. The
+/// torsion table is one or two dimensional depending on the residue, both
+/// are empty for residues without torsion statistics.
+struct ResidueTables
+{
+	ScoringTable<2> ramachandran;
+	ScoringTable<2> torsion2;
+	ScoringTable<1> torsion1;
+
+	/// Use torsion table \a d, or none when \a d is null
+	void setTorsion(const Data *d)
+	{
+		torsion2 = d ? d->scoringTable<2>() : ScoringTable<2>{};
+		torsion1 = d ? d->scoringTable<1>() : ScoringTable<1>{};
+	}
+};
+
+/// Score residue \a i with the angles in \a dihedrals, classified as \a rc,
+/// using \a tables. The identifying fields of \a residue are kept. All
+/// scoring paths end up here. Nothing is returned when only the torsion is
+/// scored and the residue has no torsion score.
+std::optional<ResidueScore> scoreResidue(ResidueScore residue, size_t i, const PolymerDihedrals &dihedrals,
+	const ResidueClass &rc, const ResidueTables &tables, const TortoizeOptions &options);
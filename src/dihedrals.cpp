@@ -0,0 +1,389 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2020 NKI/AVL, Netherlands Cancer Institute
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "dihedrals.hpp"
+
+#include <cmath>
+
+// --------------------------------------------------------------------
+// The atoms defining the chi angles, as used by cif::mm::residue
+
+const std::map<std::string, std::vector<std::string>> kChiAtomsMap = {
+	{ "ASP", { "CG", "OD1" } },
+	{ "ASN", { "CG", "OD1" } },
+	{ "ARG", { "CG", "CD", "NE", "CZ" } },
+	{ "HIS", { "CG", "ND1" } },
+	{ "GLN", { "CG", "CD", "OE1" } },
+	{ "GLU", { "CG", "CD", "OE1" } },
+	{ "SER", { "OG" } },
+	{ "THR", { "OG1" } },
+	{ "LYS", { "CG", "CD", "CE", "NZ" } },
+	{ "TYR", { "CG", "CD1" } },
+	{ "PHE", { "CG", "CD1" } },
+	{ "LEU", { "CG", "CD1" } },
+	{ "TRP", { "CG", "CD1" } },
+	{ "MET", { "CG", "SD", "CE" } },
+	{ "ILE", { "CG1", "CD1" } },
+	{ "CYS", { "SG" } },
+	{ "VAL", { "CG1" } },
+	{ "PRO", { "CG", "CD" } }
+};
+
+// The atom name for each slot in PolymerTopology, per compound. Built once
+// from the table above.
+
+struct CompoundChiAtoms
+{
+	uint8_t count;
+	std::array<std::string, PolymerTopology::SlotCount> atoms;
+	PolymerTopology::Chirality chirality;
+};
+
+const CompoundChiAtoms &compoundChiAtoms(const std::string &compoundID)
+{
+	using Topology = PolymerTopology;
+
+	static const auto sTable = []()
+	{
+		std::map<std::string, CompoundChiAtoms> result;
+
+		for (auto &[compoundID, atoms] : kChiAtomsMap)
+		{
+			CompoundChiAtoms &cca = result[compoundID];
+
+			cca.count = static_cast<uint8_t>(atoms.size());
+			cca.atoms[Topology::N] = "N";
+			cca.atoms[Topology::CA] = "CA";
+			cca.atoms[Topology::C] = "C";
+			cca.atoms[Topology::CB] = "CB";
+			cca.atoms[Topology::Chi1] = atoms[0];
+			if (atoms.size() > 1)
+				cca.atoms[Topology::Chi2] = atoms[1];
+
+			if (compoundID == "LEU")
+			{
+				cca.atoms[Topology::Alternate] = "CD2";
+				cca.chirality = Topology::Chirality::leucine;
+			}
+			else if (compoundID == "VAL")
+			{
+				cca.atoms[Topology::Alternate] = "CG2";
+				cca.chirality = Topology::Chirality::valine;
+			}
+			else
+				cca.chirality = Topology::Chirality::none;
+		}
+
+		// residues without chi angles
+		auto &none = result[""];
+		none.count = 0;
+		none.atoms[Topology::N] = "N";
+		none.atoms[Topology::CA] = "CA";
+		none.atoms[Topology::C] = "C";
+		none.chirality = Topology::Chirality::none;
+
+		return result;
+	}();
+
+	auto i = sTable.find(compoundID);
+	if (i == sTable.end())
+		i = sTable.find("");
+
+	return i->second;
+}
+
+// --------------------------------------------------------------------
+
+PolymerTopology::PolymerTopology(const cif::mm::polymer &poly)
+{
+	residues.reserve(poly.size());
+
+	for (size_t i = 0; i < poly.size(); ++i)
+	{
+		auto &res = poly[i];
+		auto &cca = compoundChiAtoms(res.get_compound_id());
+
+		Residue r;
+		r.atoms.fill(kNoAtom);
+		r.chiCount = cca.count;
+		r.chirality = cca.chirality;
+		r.linked = i > 0 and poly[i - 1].get_seq_id() + 1 == res.get_seq_id();
+
+		// As in cif::mm::residue::get_atom_by_atom_id the first atom with
+		// a matching name is used
+		auto &atoms = res.atoms();
+		for (size_t ai = 0; ai < atoms.size() and ai < kNoAtom; ++ai)
+		{
+			auto id = atoms[ai].get_label_atom_id();
+
+			for (size_t slot = 0; slot < SlotCount; ++slot)
+			{
+				if (r.atoms[slot] == kNoAtom and not cca.atoms[slot].empty() and cca.atoms[slot] == id)
+					r.atoms[slot] = static_cast<uint16_t>(ai);
+			}
+		}
+
+		residues.push_back(r);
+	}
+}
+
+// --------------------------------------------------------------------
+// The coordinates for a series of dihedral angles, in structure of arrays
+// layout. The calculation is a branch free loop over contiguous arrays
+// that the compiler can vectorise, special cases are handled afterwards.
+
+class DihedralBatch
+{
+  public:
+	void add(size_t index, const cif::point *p1, const cif::point *p2, const cif::point *p3, const cif::point *p4)
+	{
+		if (p1 == nullptr or p2 == nullptr or p3 == nullptr or p4 == nullptr)
+			return;
+
+		m_index.push_back(index);
+
+		const cif::point *p[4] = { p1, p2, p3, p4 };
+		for (size_t k = 0; k < 4; ++k)
+		{
+			m_x[k].push_back(p[k]->get_x());
+			m_y[k].push_back(p[k]->get_y());
+			m_z[k].push_back(p[k]->get_z());
+		}
+	}
+
+	/// Store the angles in \a result, at the indices passed to add
+	void calculate(std::vector<float> &result) const;
+
+  private:
+	std::vector<size_t> m_index;
+	std::vector<float> m_x[4], m_y[4], m_z[4];
+};
+
+void DihedralBatch::calculate(std::vector<float> &result) const
+{
+	const size_t n = m_index.size();
+
+	std::vector<float> uu(n), vv(n), pu(n), pv(n);
+
+	const float *x1 = m_x[0].data(), *x2 = m_x[1].data(), *x3 = m_x[2].data(), *x4 = m_x[3].data();
+	const float *y1 = m_y[0].data(), *y2 = m_y[1].data(), *y3 = m_y[2].data(), *y4 = m_y[3].data();
+	const float *z1 = m_z[0].data(), *z2 = m_z[1].data(), *z3 = m_z[2].data(), *z4 = m_z[3].data();
+
+	// Same formula as cif::dihedral_angle
+	for (size_t i = 0; i < n; ++i)
+	{
+		float v12x = x1[i] - x2[i], v12y = y1[i] - y2[i], v12z = z1[i] - z2[i];
+		float v43x = x4[i] - x3[i], v43y = y4[i] - y3[i], v43z = z4[i] - z3[i];
+		float zx = x2[i] - x3[i], zy = y2[i] - y3[i], zz = z2[i] - z3[i];
+
+		// p = z x v12
+		float px = zy * v12z - zz * v12y;
+		float py = zz * v12x - zx * v12z;
+		float pz = zx * v12y - zy * v12x;
+
+		// x = z x v43
+		float xx = zy * v43z - zz * v43y;
+		float xy = zz * v43x - zx * v43z;
+		float xz = zx * v43y - zy * v43x;
+
+		// y = z x x
+		float yx = zy * xz - zz * xy;
+		float yy = zz * xx - zx * xz;
+		float yz = zx * xy - zy * xx;
+
+		uu[i] = xx * xx + xy * xy + xz * xz;
+		vv[i] = yx * yx + yy * yy + yz * yz;
+		pu[i] = px * xx + py * xy + pz * xz;
+		pv[i] = px * yx + py * yy + pz * yz;
+	}
+
+	const float kRadToDeg = static_cast<float>(180 / cif::kPI);
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		float angle = 360;
+
+		if (uu[i] > 0 and vv[i] > 0)
+		{
+			float u = pu[i] / std::sqrt(uu[i]);
+			float v = pv[i] / std::sqrt(vv[i]);
+
+			if (u != 0 or v != 0)
+				angle = std::atan2(v, u) * kRadToDeg;
+		}
+
+		result[m_index[i]] = angle;
+	}
+}
+
+// --------------------------------------------------------------------
+
+PolymerDihedrals::PolymerDihedrals(const cif::mm::polymer &poly, Angles angles)
+	: PolymerDihedrals(poly, PolymerTopology(poly), angles)
+{
+}
+
+PolymerDihedrals::PolymerDihedrals(const cif::mm::polymer &poly, const PolymerTopology &topology, Angles angles)
+	: m_angles(angles)
+{
+	init(poly.size());
+
+	calculate(topology, 0, poly.size(), [&poly, &topology](size_t i, size_t slot, cif::point &location)
+		{
+			auto ix = topology.residues[i].atoms[slot];
+			if (ix == PolymerTopology::kNoAtom)
+				return false;
+			location = poly[i].atoms()[ix].get_location();
+			return true; });
+}
+
+PolymerDihedrals::PolymerDihedrals(const PolymerTopology &topology, const CoordinateIndex &index, const std::vector<cif::point> &coordinates,
+	Angles angles)
+	: m_angles(angles)
+{
+	init(topology.residues.size());
+
+	calculate(topology, 0, topology.residues.size(), [&index, &coordinates](size_t i, size_t slot, cif::point &location)
+		{
+			auto ix = index[i][slot];
+			if (ix == PolymerTopology::kNoCoordinate)
+				return false;
+			location = coordinates[ix];
+			return true; });
+}
+
+void PolymerDihedrals::init(size_t n)
+{
+	phi.assign(n, 360);
+	psi.assign(n, 360);
+	omega.assign(n, 360);
+	chi1.assign(n, 0);
+	chi2.assign(n, 0);
+	chiCount.assign(n, 0);
+}
+
+void PolymerDihedrals::update(const cif::mm::polymer &poly, const PolymerTopology &topology, size_t i)
+{
+	size_t from = i > 0 ? i - 1 : 0;
+	size_t to = std::min(i + 2, poly.size());
+
+	calculate(topology, from, to, [&poly, &topology](size_t i, size_t slot, cif::point &location)
+		{
+			auto ix = topology.residues[i].atoms[slot];
+			if (ix == PolymerTopology::kNoAtom)
+				return false;
+			location = poly[i].atoms()[ix].get_location();
+			return true; });
+}
+
+template <typename Locate>
+void PolymerDihedrals::calculate(const PolymerTopology &topology, size_t from, size_t to, Locate &&locate)
+{
+	using Topology = PolymerTopology;
+
+	const size_t n = topology.residues.size();
+
+	// The atom locations of the residues, including the neighbours needed
+	// for phi and psi. Missing atoms are null.
+	size_t first = from > 0 ? from - 1 : 0;
+	size_t last = std::min(to + 1, n);
+
+	const bool withOmega = m_angles & Omega;
+	const bool withChi = m_angles & Chi;
+
+	std::vector<std::array<cif::point, Topology::SlotCount>> locations(last - first);
+	std::vector<std::array<const cif::point *, Topology::SlotCount>> atoms(last - first);
+
+	// The side chain atoms follow the backbone atoms in the slots
+	const size_t slotCount = withChi ? Topology::SlotCount : Topology::CB;
+
+	for (size_t i = first; i < last; ++i)
+	{
+		atoms[i - first].fill(nullptr);
+
+		for (size_t slot = 0; slot < slotCount; ++slot)
+		{
+			auto &location = locations[i - first][slot];
+			atoms[i - first][slot] = locate(i, slot, location) ? &location : nullptr;
+		}
+	}
+
+	DihedralBatch phiBatch, psiBatch, omegaBatch, chi1Batch, chi2Batch;
+
+	for (size_t i = from; i < to; ++i)
+	{
+		auto &r = topology.residues[i];
+		auto &a = atoms[i - first];
+
+		phi[i] = psi[i] = omega[i] = 360;
+		chi1[i] = chi2[i] = 0;
+		chiCount[i] = withChi ? r.chiCount : 0;
+
+		if (r.linked)
+			phiBatch.add(i, atoms[i - 1 - first][Topology::C], a[Topology::N], a[Topology::CA], a[Topology::C]);
+
+		if (i + 1 < n and topology.residues[i + 1].linked)
+			psiBatch.add(i, a[Topology::N], a[Topology::CA], a[Topology::C], atoms[i + 1 - first][Topology::N]);
+
+		// omega, like cif::mm::residue, does not check the sequence
+		if (withOmega and i + 1 < n)
+			omegaBatch.add(i, a[Topology::CA], a[Topology::C], atoms[i + 1 - first][Topology::N], atoms[i + 1 - first][Topology::CA]);
+
+		if (chiCount[i] == 0)
+			continue;
+
+		std::array<const cif::point *, 5> path{ a[Topology::N], a[Topology::CA], a[Topology::CB], a[Topology::Chi1], a[Topology::Chi2] };
+
+		// The chi angles are all 0 when the chiral volume cannot be calculated
+		if (r.chirality != Topology::Chirality::none)
+		{
+			const cif::point *centre, *a1, *a2, *a3 = a[Topology::Alternate];
+			size_t swapped;
+
+			if (r.chirality == Topology::Chirality::leucine)
+				centre = a[Topology::Chi1], a1 = a[Topology::CB], a2 = a[Topology::Chi2], swapped = 4;
+			else
+				centre = a[Topology::CB], a1 = a[Topology::CA], a2 = a[Topology::Chi1], swapped = 3;
+
+			if (centre == nullptr or a1 == nullptr or a2 == nullptr or a3 == nullptr)
+				continue;
+
+			float chiralVolume = cif::dot_product(*a1 - *centre, cif::cross_product(*a2 - *centre, *a3 - *centre));
+			if (chiralVolume > 0)
+				path[swapped] = a3;
+		}
+
+		chi1Batch.add(i, path[0], path[1], path[2], path[3]);
+		if (r.chiCount > 1)
+			chi2Batch.add(i, path[1], path[2], path[3], path[4]);
+	}
+
+	phiBatch.calculate(phi);
+	psiBatch.calculate(psi);
+	omegaBatch.calculate(omega);
+	chi1Batch.calculate(chi1);
+	chi2Batch.calculate(chi2);
+}
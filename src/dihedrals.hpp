@@ -0,0 +1,131 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2020 NKI/AVL, Netherlands Cancer Institute
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+// Internal header, calculation of the dihedral angles for all residues
+// of a polymer at once.
+
+#include <cif++.hpp>
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+/// The atoms needed for the dihedral angles of the residues in a polymer,
+/// stored as indices into cif::mm::residue::atoms(). The atom names are
+/// resolved only once, the topology remains valid for any number of
+/// coordinate changes as long as no atoms are added or removed.
+
+struct PolymerTopology
+{
+	enum Slot : uint8_t
+	{
+		N,
+		CA,
+		C,
+		CB,
+		Chi1,      ///< The last atom of chi1
+		Chi2,      ///< The last atom of chi2
+		Alternate, ///< Replaces the last chi atom for LEU and VAL, see below
+		SlotCount
+	};
+
+	/// cif::mm::residue uses CD2 for LEU and CG2 for VAL instead of the
+	/// last chi atom when the chiral volume is positive
+	enum class Chirality : uint8_t
+	{
+		none,
+		leucine,
+		valine
+	};
+
+	static constexpr uint16_t kNoAtom = 0xffff;
+	static constexpr uint32_t kNoCoordinate = 0xffffffff;
+
+	struct Residue
+	{
+		std::array<uint16_t, SlotCount> atoms;
+		uint8_t chiCount;
+		Chirality chirality;
+		bool linked; ///< The seq_id directly follows that of the previous residue
+	};
+
+	PolymerTopology(const cif::mm::polymer &poly);
+
+	std::vector<Residue> residues;
+};
+
+/// The phi, psi, chi1 and chi2 angles of the residues in a polymer,
+/// indexed like the polymer itself.
+///
+/// The values are the same as those returned by cif::mm::residue: phi and
+/// psi are 360 when they cannot be calculated, e.g. for a gap in the
+/// sequence or missing atoms, chi angles with missing atoms are 0.
+
+struct PolymerDihedrals
+{
+	/// For each residue the index of the atom in each slot into a separate
+	/// array of coordinates, or kNoCoordinate
+	using CoordinateIndex = std::vector<std::array<uint32_t, PolymerTopology::SlotCount>>;
+
+	/// The angles to calculate besides phi and psi. Angles that are not
+	/// calculated keep the value for missing atoms and chiCount is 0.
+	enum Angles : uint8_t
+	{
+		Omega = 1 << 0, ///< Needed for isCis
+		Chi = 1 << 1,
+		AllAngles = Omega | Chi
+	};
+
+	PolymerDihedrals(const cif::mm::polymer &poly, Angles angles = AllAngles);
+	PolymerDihedrals(const cif::mm::polymer &poly, const PolymerTopology &topology, Angles angles = AllAngles);
+
+	/// Calculate the angles using the locations in \a coordinates
+	PolymerDihedrals(const PolymerTopology &topology, const CoordinateIndex &index, const std::vector<cif::point> &coordinates,
+		Angles angles = AllAngles);
+
+	/// Recalculate the angles that depend on the atoms of residue \a i,
+	/// those of the residue itself and of its direct neighbours
+	void update(const cif::mm::polymer &poly, const PolymerTopology &topology, size_t i);
+
+	/// As cif::mm::residue::is_cis, the peptide bond to the next residue is cis
+	bool isCis(size_t i) const
+	{
+		return omega[i] > -30 and omega[i] < 30;
+	}
+
+	std::vector<float> phi, psi, omega, chi1, chi2;
+	std::vector<uint8_t> chiCount;
+
+  private:
+	void init(size_t n);
+
+	Angles m_angles;
+
+	template <typename Locate>
+	void calculate(const PolymerTopology &topology, size_t from, size_t to, Locate &&locate);
+};
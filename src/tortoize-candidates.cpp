@@ -0,0 +1,267 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2020 NKI/AVL, Netherlands Cancer Institute
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "tortoize.hpp"
+#include "data-table.hpp"
+#include "dihedrals.hpp"
+
+#include <limits>
+
+// --------------------------------------------------------------------
+// Everything about a residue that does not depend on its coordinates
+
+struct CandidateScorer::Residue
+{
+	ResidueScore ids;
+	std::string aa; ///< The compound ID used for the tables
+	bool prepro, proline;
+	bool selected;
+
+	// The tables per secondary structure, indexed by secStrIndex, resolved
+	// for scoring. Empty when there is no such table.
+	ScoringTable<2> rama[3], ramaCis, ramaPrepro;
+	ScoringTable<2> torsion2[3];
+	ScoringTable<1> torsion1[3];
+};
+
+struct CandidateScorer::Polymer
+{
+	std::string asymID, entityID;
+	PolymerTopology topology;
+	PolymerDihedrals::CoordinateIndex index;
+	std::vector<Residue> residues;
+};
+
+static size_t secStrIndex(SecStrType ss)
+{
+	switch (ss)
+	{
+		case SecStrType::helix: return 0;
+		case SecStrType::strand: return 1;
+		default: return 2;
+	}
+}
+
+// --------------------------------------------------------------------
+
+CandidateScorer::CandidateScorer(const cif::mm::structure &topology, const TortoizeOptions &options)
+	: m_options(options)
+	, m_tables(options.tables ? options.tables : defaultDataTable())
+	, m_atomCount(topology.atoms().size())
+{
+	auto &tbl = *m_tables;
+
+	std::map<std::string, uint32_t> atomIndex;
+	for (auto &atom : topology.atoms())
+		atomIndex.emplace(atom.id(), static_cast<uint32_t>(atomIndex.size()));
+
+	auto find = [&tbl](auto load, const std::string &aa, SecStrType ss) -> const Data *
+	{
+		try
+		{
+			return &(tbl.*load)(aa, ss);
+		}
+		catch (const std::exception &)
+		{
+			return nullptr;
+		}
+	};
+
+	for (auto &poly : topology.polymers())
+	{
+		Polymer p{ poly.get_asym_id(), poly.get_entity_id(), PolymerTopology(poly), {}, {} };
+
+		for (size_t i = 0; i < poly.size(); ++i)
+		{
+			auto &res = poly[i];
+
+			std::array<uint32_t, PolymerTopology::SlotCount> index;
+			for (size_t slot = 0; slot < PolymerTopology::SlotCount; ++slot)
+			{
+				auto ix = p.topology.residues[i].atoms[slot];
+				index[slot] = ix == PolymerTopology::kNoAtom ? PolymerTopology::kNoCoordinate : atomIndex.at(res.atoms()[ix].id());
+			}
+			p.index.push_back(index);
+
+			Residue r{};
+
+			r.ids.asymID = res.get_asym_id();
+			r.ids.seqID = res.get_seq_id();
+			r.ids.compoundID = res.get_compound_id();
+			r.ids.authAsymID = res.get_auth_asym_id();
+			r.ids.authSeqID = std::stoi(res.get_auth_seq_id());
+			r.ids.pdbInsCode = res.get_pdb_ins_code();
+
+			r.aa = remapCompoundID(r.ids.compoundID, m_options.verbose);
+			r.selected = isSelected(m_options.selection, r.ids.asymID, r.ids.seqID);
+			r.proline = r.aa == "PRO";
+			r.prepro = not r.proline and i + 1 < poly.size() and poly[i + 1].get_compound_id() == "PRO";
+
+			const bool withRama = m_options.only != ScoreType::torsion;
+			const bool withTorsion = m_options.only != ScoreType::ramachandran;
+
+			auto rama = [&](SecStrType ss)
+			{
+				auto d = withRama ? find(&DataTable::loadRamachandranData, r.aa, ss) : nullptr;
+				return d ? d->scoringTable<2>() : ScoringTable<2>{};
+			};
+
+			for (auto ss : { SecStrType::helix, SecStrType::strand, SecStrType::other })
+			{
+				r.rama[secStrIndex(ss)] = rama(ss);
+
+				if (auto d = withTorsion ? find(&DataTable::loadTorsionData, r.aa, ss) : nullptr)
+				{
+					r.torsion2[secStrIndex(ss)] = d->scoringTable<2>();
+					r.torsion1[secStrIndex(ss)] = d->scoringTable<1>();
+				}
+			}
+
+			r.ramaCis = rama(SecStrType::cis);
+			r.ramaPrepro = rama(SecStrType::prepro);
+
+			p.residues.push_back(std::move(r));
+		}
+
+		m_polymers.push_back(std::move(p));
+	}
+
+	m_secstr = assignSecStr(topology);
+}
+
+CandidateScorer::~CandidateScorer() = default;
+
+std::vector<std::optional<SecStrType>> CandidateScorer::assignSecStr(const cif::mm::structure &structure) const
+{
+	auto secstr = m_options.secondaryStructure ? m_options.secondaryStructure(structure) : assignSecStrUsingDSSP(structure);
+
+	std::vector<std::optional<SecStrType>> result;
+	for (auto &poly : structure.polymers())
+	{
+		for (auto &res : poly)
+			result.push_back(secstr(res));
+	}
+
+	return result;
+}
+
+ModelScore CandidateScorer::score(const cif::mm::structure &candidate) const
+{
+	auto &atoms = candidate.atoms();
+
+	if (atoms.size() != m_atomCount)
+		throw std::runtime_error("The candidate does not have the same atoms as the topology");
+
+	std::vector<cif::point> coordinates;
+	coordinates.reserve(atoms.size());
+	for (auto &atom : atoms)
+		coordinates.push_back(atom.get_location());
+
+	auto secstr = assignSecStr(candidate);
+	if (secstr.size() != m_secstr.size())
+		throw std::runtime_error("The candidate does not have the same residues as the topology");
+
+	return score(coordinates, secstr);
+}
+
+ModelScore CandidateScorer::score(const std::vector<cif::point> &coordinates) const
+{
+	if (coordinates.size() != m_atomCount)
+		throw std::runtime_error("The number of coordinates does not match the topology");
+
+	return score(coordinates, m_secstr);
+}
+
+ModelScore CandidateScorer::score(const std::vector<cif::point> &coordinates, const std::vector<std::optional<SecStrType>> &secstr) const
+{
+	auto &tbl = *m_tables;
+
+	ModelScore result;
+	ModelSums sums;
+
+	size_t residueIndex = 0;
+
+	for (auto &p : m_polymers)
+	{
+		PolymerDihedrals dihedrals(p.topology, p.index, coordinates, dihedralAngles(m_options.only));
+
+		for (size_t i = 0; i < p.residues.size(); ++i, ++residueIndex)
+		{
+			if (i == 0 or i + 1 == p.residues.size())
+				continue;
+
+			auto &r = p.residues[i];
+			if (not r.selected)
+				continue;
+
+			if (dihedrals.phi[i] == 360 or dihedrals.psi[i] == 360)
+				continue;
+
+			auto ss = secstr[residueIndex];
+			if (not ss)
+			{
+				if (m_options.verbose > 0)
+					std::cerr << "Residue " << r.ids.asymID << ' ' << r.ids.seqID << " is missing in DSSP" << std::endl;
+				continue;
+			}
+
+			// The same classification as classifyResidue, using the
+			// flags determined from the topology
+			ResidueClass rc{ r.aa, *ss, *ss };
+			ResidueTables tables;
+
+			if (r.prepro)
+				rc.ramachandranSS = SecStrType::prepro, tables.ramachandran = r.ramaPrepro;
+			else if (r.proline and dihedrals.isCis(i))
+				rc.ramachandranSS = SecStrType::cis, tables.ramachandran = r.ramaCis;
+			else
+				tables.ramachandran = r.rama[secStrIndex(rc.torsionSS)];
+
+			// throws the same exception as the normal scoring
+			if (m_options.only != ScoreType::torsion and not tables.ramachandran)
+				tables.ramachandran = tbl.loadRamachandranData(r.aa, rc.ramachandranSS).scoringTable<2>();
+
+			tables.torsion2 = r.torsion2[secStrIndex(rc.torsionSS)];
+			tables.torsion1 = r.torsion1[secStrIndex(rc.torsionSS)];
+
+			auto residue = scoreResidue(m_options.summaryOnly ? ResidueScore{} : r.ids, i, dihedrals, rc, tables, m_options);
+			if (not residue)
+				continue;
+
+			sums.add(p.asymID, p.entityID, *residue);
+
+			if (not m_options.summaryOnly)
+				result.residues.push_back(std::move(*residue));
+		}
+	}
+
+	if (not m_options.windows.empty())
+		calculateLocalZScores(result.residues, m_options.windows, tbl);
+
+	sums.store(result, tbl, m_options.only);
+
+	return result;
+}
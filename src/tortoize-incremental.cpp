@@ -0,0 +1,196 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2020 NKI/AVL, Netherlands Cancer Institute
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "tortoize.hpp"
+#include "data-table.hpp"
+#include "dihedrals.hpp"
+
+#include <cmath>
+#include <limits>
+#include <set>
+
+// --------------------------------------------------------------------
+
+IncrementalScorer::IncrementalScorer(const cif::mm::structure &structure, const TortoizeOptions &options)
+	: m_structure(structure)
+	, m_options(options)
+	, m_tables(options.tables ? options.tables : defaultDataTable())
+	, m_secstr(options.secondaryStructure ? options.secondaryStructure(structure) : assignSecStrUsingDSSP(structure))
+	, m_groups(new GroupedSums)
+{
+	for (auto &poly : m_structure.polymers())
+	{
+		m_topology.emplace_back(poly);
+		m_dihedrals.emplace_back(poly, m_topology.back(), dihedralAngles(m_options.only));
+
+		for (size_t i = 0; i < poly.size(); ++i)
+		{
+			m_index[{ poly[i].get_asym_id(), poly[i].get_seq_id() }] = m_residues.size();
+			m_residues.push_back({ &poly, m_dihedrals.size() - 1, i, m_secstr(poly[i]), {} });
+		}
+	}
+
+	for (auto &entry : m_residues)
+		rescore(entry);
+}
+
+IncrementalScorer::~IncrementalScorer() = default;
+
+void IncrementalScorer::update(const std::vector<std::tuple<std::string, int>> &residues)
+{
+	// Collect the changed residues and their neighbours first, a residue
+	// should be rescored only once
+	std::set<size_t> affected;
+
+	for (auto &key : residues)
+	{
+		auto i = m_index.find(key);
+		if (i == m_index.end())
+			continue;
+
+		auto &entry = m_residues[i->second];
+
+		m_dihedrals[entry.polyIndex].update(*entry.poly, m_topology[entry.polyIndex], entry.index);
+
+		if (entry.index > 0)
+			affected.insert(i->second - 1);
+		affected.insert(i->second);
+		if (entry.index + 1 < entry.poly->size())
+			affected.insert(i->second + 1);
+	}
+
+	for (auto ix : affected)
+		rescore(m_residues[ix]);
+}
+
+void IncrementalScorer::update(const std::vector<cif::mm::atom> &atoms)
+{
+	std::vector<std::tuple<std::string, int>> residues;
+	for (auto &atom : atoms)
+		residues.emplace_back(atom.get_label_asym_id(), atom.get_label_seq_id());
+
+	update(residues);
+}
+
+void IncrementalScorer::updateSecondaryStructure()
+{
+	m_secstr = m_options.secondaryStructure ? m_options.secondaryStructure(m_structure) : assignSecStrUsingDSSP(m_structure);
+
+	for (auto &entry : m_residues)
+	{
+		auto ss = m_secstr((*entry.poly)[entry.index]);
+		if (ss == entry.ss)
+			continue;
+
+		entry.ss = ss;
+		rescore(entry);
+	}
+}
+
+void IncrementalScorer::rescore(Entry &entry)
+{
+	if (entry.score)
+		add(entry, -1);
+
+	// the secondary structure cached in the entry saves a lookup in m_secstr
+	entry.score = scoreResidue(*entry.poly, entry.index, m_dihedrals[entry.polyIndex], entry.ss, *m_tables, m_options);
+
+	if (entry.score)
+		add(entry, 1);
+}
+
+void IncrementalScorer::add(const Entry &entry, int sign)
+{
+	auto &score = *entry.score;
+
+	m_groups->add(entry.poly->get_asym_id(), entry.poly->get_entity_id(), score, sign);
+
+	if (m_options.only != ScoreType::torsion)
+	{
+		double zr = score.ramachandranZ;
+
+		m_ramaSum += sign * zr;
+		m_ramaSumSq += sign * zr * zr;
+		m_ramaCount = sign > 0 ? m_ramaCount + 1 : m_ramaCount - 1;
+	}
+
+	if (score.torsionZ)
+	{
+		double zt = *score.torsionZ;
+
+		m_torsSum += sign * zt;
+		m_torsSumSq += sign * zt * zt;
+		m_torsCount = sign > 0 ? m_torsCount + 1 : m_torsCount - 1;
+	}
+}
+
+ModelScore IncrementalScorer::summary() const
+{
+	auto &tbl = *m_tables;
+
+	ModelScore result;
+
+	float ramaVsRand = static_cast<float>(m_ramaSum / m_ramaCount);
+	float torsVsRand = static_cast<float>(m_torsSum / m_torsCount);
+
+	result.ramachandranZ = result.ramachandranJackknifeSD = std::numeric_limits<float>::quiet_NaN();
+	result.torsionZ = result.torsionJackknifeSD = std::numeric_limits<float>::quiet_NaN();
+
+	if (m_options.only != ScoreType::torsion)
+	{
+		result.ramachandranZ = (ramaVsRand - tbl.mean_ramachandran()) / tbl.sd_ramachandran();
+		result.ramachandranJackknifeSD = jackknife(m_ramaSum, m_ramaSumSq, m_ramaCount, tbl.sd_ramachandran());
+	}
+
+	if (m_options.only != ScoreType::ramachandran)
+	{
+		result.torsionZ = (torsVsRand - tbl.mean_torsion()) / tbl.sd_torsion();
+		result.torsionJackknifeSD = jackknife(m_torsSum, m_torsSumSq, m_torsCount, tbl.sd_ramachandran());
+	}
+
+	m_groups->store(result, tbl);
+
+	return result;
+}
+
+ModelScore IncrementalScorer::score() const
+{
+	ModelScore result = summary();
+
+	if (not m_options.summaryOnly)
+	{
+		for (auto &entry : m_residues)
+		{
+			if (entry.score)
+				result.residues.push_back(*entry.score);
+		}
+
+		if (not m_options.windows.empty())
+			calculateLocalZScores(result.residues, m_options.windows, *m_tables);
+	}
+
+	return result;
+}
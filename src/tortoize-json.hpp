@@ -0,0 +1,49 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ * 
+ * Copyright (c) 2020 NKI/AVL, Netherlands Cancer Institute
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+// The JSON interface, as used by the tortoize application. Kept apart from
+// tortoize.hpp so that users of the typed interface do not depend on
+// libzeep, code including this header has to link zeep itself.
+
+#include "tortoize.hpp"
+
+#include <zeep/json/element.hpp>
+
+zeep::json::element to_json(const ResidueScore &score);
+zeep::json::element to_json(const GroupScore &score);
+zeep::json::element to_json(const ModelScore &score);
+
+/// The tortoize output format, including a software block
+zeep::json::element to_json(const std::vector<ModelScore> &scores);
+
+zeep::json::element calculateZScores(const cif::mm::structure& structure, const TortoizeOptions &options = {});
+
+zeep::json::element tortoize_calculate(const std::filesystem::path &xyzin, const TortoizeOptions &options = {});
+
+/// Calculate the z-scores for all models in \a file
+zeep::json::element tortoize_calculate(cif::file &file, const TortoizeOptions &options = {});
@@ -25,20 +25,25 @@
  */
 
 #include "tortoize.hpp"
+#include "tortoize-json.hpp"
 #include "revision.hpp"
 
 #if WEBSERVICE
-#include <zeep/http/daemon.hpp>
-#include <zeep/http/server.hpp>
-#include <zeep/http/html-controller.hpp>
-#include <zeep/http/rest-controller.hpp>
-#include <zeep/crypto.hpp>
+#include "tortoize-server.hpp"
 #endif
 
 #include <mcfp/mcfp.hpp>
 #include <cif++.hpp>
 
+#include <atomic>
+#include <cstdlib>
+#include <ctime>
 #include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
 
 namespace fs = std::filesystem;
 
@@ -51,224 +56,161 @@ using json = zeep::json::element;
 #define STDIN_FILENO 0
 #define STDOUT_FILENO 1
 #define STDERR_FILENO 2
+#else
+#include <sys/resource.h>
 #endif
 
-
-
 // --------------------------------------------------------------------
-#if WEBSERVICE
-
-class tortoize_html_controller : public zeep::http::html_controller
-{
-  public:
-	tortoize_html_controller()
-		: zeep::http::html_controller("tortoize")
-	{
-		mount("{css,scripts,fonts,images,favicon}/", &tortoize_html_controller::handle_file);
-		mount("{favicon.ico,browserconfig.xml,manifest.json}", &tortoize_html_controller::handle_file);
-		mount("", &tortoize_html_controller::index);
-	}
+// Allocation counting for --profile. The counters are only updated when
+// profiling was requested, otherwise the cost is a single relaxed load.
+// The stages are timed per thread, the allocations are therefore counted
+// per thread as well.
 
-	void index(const zeep::http::request& request, const zeep::http::scope& scope, zeep::http::reply& reply)
-	{
-		get_template_processor().create_reply_from_template("index", scope, reply);
-	}
-};
-
-// --------------------------------------------------------------------
+std::atomic<bool> gCountAllocations{ false };
+std::atomic<uint64_t> gAllocationCount{ 0 }, gAllocatedBytes{ 0 };
+thread_local uint64_t tAllocationCount = 0, tAllocatedBytes = 0;
 
-class tortoize_rest_controller : public zeep::http::rest_controller
+void *operator new(std::size_t size)
 {
-  public:
-	tortoize_rest_controller()
-		: zeep::http::rest_controller("")
-		, m_tempdir(fs::temp_directory_path() / "tortoize-ws")
+	if (gCountAllocations.load(std::memory_order_relaxed))
 	{
-		fs::create_directories(m_tempdir);
+		gAllocationCount.fetch_add(1, std::memory_order_relaxed);
+		gAllocatedBytes.fetch_add(size, std::memory_order_relaxed);
 
-		map_post_request("tortoize", &tortoize_rest_controller::calculate, "data", "dict");
+		++tAllocationCount;
+		tAllocatedBytes += size;
 	}
 
-	json calculate(const std::string& file, const std::string& dict)
-	{
-		// First store dictionary, just in case
-
-		fs::path dictFile;
-
-		if (not dict.empty())
-		{
-			dictFile = m_tempdir / ("dict-" + std::to_string(m_next_dict_nr++));
-			std::ofstream tmpFile(dictFile);
-			tmpFile << dict;
-
-			cif::compound_factory::instance().push_dictionary(dictFile);
-		}
+	if (size == 0)
+		size = 1;
 
-		try
-		{
-			// --------------------------------------------------------------------
-			
-			json data{
-				{ "software",
-					{
-						{ "name", "tortoize" },
-						{ "version", kVersionNumber },
-						{ "reference", "Sobolev et al. A Global Ramachandran Score Identifies Protein Structures with Unlikely Stereochemistry, Structure (2020)" },
-						{ "reference-doi", "https://doi.org/10.1016/j.str.2020.08.005" }
-					}
-				}
-			};
-
-			// --------------------------------------------------------------------
-
-			struct membuf : public std::streambuf
-			{
-				membuf(char *text, size_t length)
-				{
-					this->setg(text, text, text + length);
-				}
-			} buffer(const_cast<char *>(file.data()), file.length());
-
-			cif::gzio::istream in(&buffer);
-
-			cif::file f = cif::pdb::read(in);
-			if (f.empty())
-				throw std::runtime_error("Invalid mmCIF or PDB file");
-
-			std::set<uint32_t> models;
-			for (auto r: f.front()["atom_site"])
-			{
-				if (not r["pdbx_PDB_model_num"].empty())
-					models.insert(r["pdbx_PDB_model_num"].as<uint32_t>());
-			}
-
-			if (models.empty())
-				models.insert(0);
-
-			for (auto model: models)
-			{
-				cif::mm::structure structure(f, model);
-				data["model"][std::to_string(model)] = calculateZScores(structure);
-			}
-
-			if (not dictFile.empty())
-			{
-				cif::compound_factory::instance().pop_dictionary();
-				fs::remove(dictFile);
-			}
-
-			return data;
-		}
-		catch (...)
-		{
-			std::error_code ec;
+	for (;;)
+	{
+		if (void *p = std::malloc(size))
+			return p;
 
-			if (not dictFile.empty())
-			{
-				cif::compound_factory::instance().pop_dictionary();
-				fs::remove(dictFile);
-			}
+		auto handler = std::get_new_handler();
+		if (handler == nullptr)
+			throw std::bad_alloc();
 
-			throw;
-		}
+		handler();
 	}
+}
 
-	fs::path m_tempdir;
-	size_t m_next_dict_nr = 1;
-};
-
-int start_server(int argc, char* argv[])
+void operator delete(void *p) noexcept
 {
-	using namespace std::literals;
-	namespace zh = zeep::http;
-
-	cif::compound_factory::init(true);
-
-	int result = 0;
-
-	auto &config = mcfp::config::instance();
+	std::free(p);
+}
 
-	config.init("tortoize server [options] start|stop|status|reload",
-		mcfp::make_option("help,h", "Display help message"),
-		mcfp::make_option("version", "Print version"),
-		mcfp::make_option("verbose,v", "verbose output"),
+void operator delete(void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
 
-		mcfp::make_option<std::string>("address", "0.0.0.0", "External address"),
-		mcfp::make_option<uint16_t>("port", 10350, "Port to listen to"),
-		mcfp::make_option<std::string>("user,u", "www-data", "User to run the daemon"),
+// Peak resident set size in bytes
+size_t peakMemoryUsage()
+{
+	size_t result = 0;
 
-		mcfp::make_option("no-daemon,F", "Do not fork into background"));
+#ifndef _MSC_VER
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+	{
+#if defined(__APPLE__)
+		result = usage.ru_maxrss;
+#else
+		result = usage.ru_maxrss * 1024;
+#endif
+	}
+#endif
 
-	config.parse(argc, argv);
+	return result;
+}
 
-	// --------------------------------------------------------------------
+// --------------------------------------------------------------------
+// Collects the timing of each stage per model for --profile. Models can
+// be scored concurrently, the model and the start of the current stage
+// are kept per thread.
 
-	if (config.has("version"))
+class CLIProfile : public ProfileSink
+{
+  public:
+	CLIProfile()
+		: m_wall_start(std::chrono::steady_clock::now())
+		, m_cpu_start(std::clock())
 	{
-		write_version_string(std::cout, config.has("verbose"));
-		exit(0);
+		gCountAllocations = true;
 	}
 
-	if (config.has("help"))
+	~CLIProfile()
 	{
-		std::cout << config << std::endl;
-		exit(0);
+		gCountAllocations = false;
 	}
-	
-	if (config.operands().empty())
+
+	void begin_model(uint32_t nr) override
 	{
-		std::cerr << "Missing command, should be one of start, stop, status or reload" << std::endl;
-		exit(1);
+		std::unique_lock lock(m_mutex);
+		m_threads[std::this_thread::get_id()].model = std::to_string(nr);
 	}
 
-	cif::VERBOSE = config.count("verbose");
-
-	std::string user = config.get<std::string>("user");
-	std::string address = config.get<std::string>("address");
-	uint16_t port = config.get<uint16_t>("port");
-
-	zh::daemon server([&]()
+	void begin_stage(Stage stage) override
 	{
-		auto s = new zeep::http::server();
+		std::unique_lock lock(m_mutex);
+		auto &state = m_threads[std::this_thread::get_id()];
+		state.stageAllocations = tAllocationCount;
+		state.stageBytes = tAllocatedBytes;
+	}
 
-#if DEBUG
-		s->set_template_processor(new zeep::http::file_based_html_template_processor("docroot"));
-#else
-		s->set_template_processor(new zeep::http::rsrc_based_html_template_processor());
-#endif
-		s->add_controller(new tortoize_rest_controller());
-		s->add_controller(new tortoize_html_controller());
-		return s;
-	}, kProjectName );
+	void record(Stage stage, std::chrono::nanoseconds wall, std::chrono::nanoseconds cpu) override
+	{
+		uint64_t allocations = tAllocationCount, bytes = tAllocatedBytes;
 
-	std::string command = config.operands().front();
+		std::unique_lock lock(m_mutex);
+		auto &state = m_threads[std::this_thread::get_id()];
 
-	if (command == "start")
-	{
-		std::cout << "starting server at http://" << address << ':' << port << '/' << std::endl;
+		json timing{
+			{ "wall-ms", std::chrono::duration<double, std::milli>(wall).count() },
+			{ "cpu-ms", std::chrono::duration<double, std::milli>(cpu).count() },
+			{ "allocations", allocations - state.stageAllocations },
+			{ "allocated-bytes", bytes - state.stageBytes }
+		};
 
-		if (config.has("no-daemon"))
-			result = server.run_foreground(address, port);
+		if (stage == Stage::Parse or stage == Stage::Serialize)
+			m_stages[to_string(stage)] = std::move(timing);
 		else
-			result = server.start(address, port, 2, 2, user);
-		// server.start(vm.count("no-daemon"), address, port, 2, user);
-		// // result = daemon::start(vm.count("no-daemon"), port, user);
+			m_stages["model"][state.model][to_string(stage)] = std::move(timing);
 	}
-	else if (command == "stop")
-		result = server.stop();
-	else if (command == "status")
-		result = server.status();
-	else if (command == "reload")
-		result = server.reload();
-	else
+
+	json result() const
 	{
-		std::cerr << "Invalid command" << std::endl;
-		result = 1;
+		std::unique_lock lock(m_mutex);
+
+		json result = m_stages;
+
+		result["total"] = {
+			{ "wall-ms", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_wall_start).count() },
+			{ "cpu-ms", 1000.0 * (std::clock() - m_cpu_start) / CLOCKS_PER_SEC },
+			{ "allocations", gAllocationCount.load(std::memory_order_relaxed) },
+			{ "allocated-bytes", gAllocatedBytes.load(std::memory_order_relaxed) },
+			{ "peak-rss-bytes", peakMemoryUsage() }
+		};
+
+		return result;
 	}
 
-	return result;
-}
-#endif
+  private:
+	struct ThreadState
+	{
+		std::string model;
+		uint64_t stageAllocations = 0, stageBytes = 0;
+	};
+
+	std::chrono::steady_clock::time_point m_wall_start;
+	std::clock_t m_cpu_start;
+	mutable std::mutex m_mutex;
+	std::map<std::thread::id, ThreadState> m_threads;
+	json m_stages;
+};
 
 // --------------------------------------------------------------------
 
@@ -294,7 +236,26 @@ int pr_main(int argc, char* argv[])
 		mcfp::make_option<std::vector<std::string>>("dict",
 			"Dictionary file containing restraints for residues in this specific target, can be specified multiple times."),
 
-		mcfp::make_hidden_option<std::string>("build", "Build a binary data table")
+		mcfp::make_option<std::vector<size_t>>("window",
+			"Add local z-scores for each residue over a window of this number of residues, can be specified multiple times."),
+
+		mcfp::make_option<std::string>("only", "Only calculate the ramachandran or the torsion scores"),
+
+		mcfp::make_option<std::string>("select",
+			"Only score these residues, a comma separated list of chains or residue ranges using the label_asym_id and label_seq_id, e.g. A,B:10-50"),
+
+		mcfp::make_option("profile", "Add the time and memory used by each stage of the calculation to the output"),
+		mcfp::make_option<std::string>("profile-output", "Write the time and memory used by each stage to this file instead"),
+
+		mcfp::make_option<std::string>("tables",
+			"Score using the rama-data.bin and torsion-data.bin tables in this directory, e.g. tables created with --train"),
+
+		mcfp::make_option<float>("bin-spacing", "The bin spacing in degrees of the tables created with --train, the default is 3"),
+
+		mcfp::make_option<size_t>("threads", 1, "Number of models, or structures when training, processed concurrently"),
+
+		mcfp::make_hidden_option<std::string>("build", "Build a binary data table"),
+		mcfp::make_hidden_option<std::string>("train", "Build new binary data tables from the structures in this directory")
 
 	);
 
@@ -341,6 +302,24 @@ References:
 		exit(0);
 	}
 
+	if (config.has("train"))
+	{
+		TrainingOptions options;
+		options.threads = config.get<size_t>("threads");
+		options.verbose = config.count("verbose");
+		if (config.has("bin-spacing"))
+			options.binSpacing = config.get<float>("bin-spacing");
+
+		trainDataFiles(config.get<std::string>("train"), fs::current_path(), options);
+		exit(0);
+	}
+
+	if (config.has("bin-spacing"))
+	{
+		std::cerr << "--bin-spacing is only used with --train, use --tables to score with trained tables" << std::endl;
+		exit(1);
+	}
+
 	if (config.operands().empty())
 	{
 		std::cerr << "Input file not specified" << std::endl;
@@ -378,7 +357,35 @@ References:
 
 	// --------------------------------------------------------------------
 	
-	json data = tortoize_calculate(config.operands().front());
+	// When the profile is added to the output itself, the time needed
+	// to write the output cannot be included.
+	std::unique_ptr<CLIProfile> profile;
+	if (config.has("profile") or config.has("profile-output"))
+		profile.reset(new CLIProfile());
+
+	TortoizeOptions options;
+	options.profile = profile.get();
+	options.verbose = cif::VERBOSE;
+	options.threads = config.get<size_t>("threads");
+
+	if (config.has("window"))
+		options.windows = config.get<std::vector<size_t>>("window");
+
+	if (config.has("only"))
+		options.only = parseScoreType(config.get<std::string>("only"));
+
+	if (config.has("select"))
+		options.selection = parseSelection(config.get<std::string>("select"));
+
+	if (config.has("tables"))
+		options.tables = loadDataTable(fs::path{ config.get<std::string>("tables") });
+
+	json data = tortoize_calculate(config.operands().front(), options);
+
+	if (profile and not config.has("profile-output"))
+		data["profile"] = profile->result();
+
+	StageTimer outputTimer(profile.get(), Stage::Serialize);
 
 	if (config.operands().size() == 2)
 	{
@@ -392,6 +399,19 @@ References:
 	}
 	else
 		std::cout << data << std::endl;
+
+	outputTimer.stop();
+
+	if (config.has("profile-output"))
+	{
+		std::ofstream of(config.get<std::string>("profile-output"));
+		if (not of.is_open())
+		{
+			std::cerr << "Could not open profile output file" << std::endl;
+			exit(1);
+		}
+		of << profile->result();
+	}
 	
 	return 0;
 }
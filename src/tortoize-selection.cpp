@@ -0,0 +1,232 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2020 NKI/AVL, Netherlands Cancer Institute
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "tortoize.hpp"
+#include "data-table.hpp"
+
+#include <cif++.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <regex>
+#include <set>
+#include <unordered_map>
+
+// --------------------------------------------------------------------
+
+Selection parseSelection(std::string_view expression)
+{
+	static const std::regex kRangeRx(R"(([^\s:,]+)(?::(-?\d+)(?:-(-?\d+))?)?)");
+
+	Selection result;
+
+	for (auto &part : cif::split<std::string>(expression, ",", true))
+	{
+		std::smatch m;
+		if (not std::regex_match(part, m, kRangeRx))
+			throw std::invalid_argument("Invalid selection '" + part + "', expected chain or chain:first-last");
+
+		ResidueRange range{ m[1].str() };
+
+		if (m[2].matched)
+		{
+			range.first = std::stoi(m[2].str());
+			range.last = m[3].matched ? std::stoi(m[3].str()) : *range.first;
+
+			if (*range.last < *range.first)
+				throw std::invalid_argument("Invalid selection '" + part + "', the range is empty");
+		}
+
+		result.push_back(std::move(range));
+	}
+
+	return result;
+}
+
+bool isSelected(const Selection &selection, const std::string &asymID, int seqID)
+{
+	return selection.empty() or
+	       std::find_if(selection.begin(), selection.end(), [&](const ResidueRange &r)
+			   { return r.contains(asymID, seqID); }) != selection.end();
+}
+
+// --------------------------------------------------------------------
+// The context kept around the selection. DSSP only considers hydrogen
+// bonds between residues whose CA atoms are closer than 9 Å. The bridge
+// and turn patterns and the phi and psi angles need the neighbours in
+// sequence of the residues involved as well.
+
+const float kContextDistance = 9.0f;
+const int kContextResidues = 2;
+
+// The selected CA atoms binned in cubic cells with an edge of
+// kContextDistance. Only the 27 cells around a point need to be searched
+// to find the atoms within kContextDistance.
+
+class CellGrid
+{
+  public:
+	void add(const cif::point &pt)
+	{
+		m_cells[key(cell(pt.m_x), cell(pt.m_y), cell(pt.m_z))].push_back(pt);
+	}
+
+	bool near(const cif::point &pt) const
+	{
+		int x = cell(pt.m_x), y = cell(pt.m_y), z = cell(pt.m_z);
+
+		for (int dx = -1; dx <= 1; ++dx)
+		{
+			for (int dy = -1; dy <= 1; ++dy)
+			{
+				for (int dz = -1; dz <= 1; ++dz)
+				{
+					auto i = m_cells.find(key(x + dx, y + dy, z + dz));
+					if (i == m_cells.end())
+						continue;
+
+					for (auto &s : i->second)
+					{
+						if (cif::distance_squared(pt, s) <= kContextDistance * kContextDistance)
+							return true;
+					}
+				}
+			}
+		}
+
+		return false;
+	}
+
+  private:
+	static int cell(float v)
+	{
+		return static_cast<int>(std::floor(v / kContextDistance));
+	}
+
+	// 21 bits per cell index is plenty, coordinates are well within
+	// +/- 9 million Å
+	static uint64_t key(int x, int y, int z)
+	{
+		const uint64_t kMask = (1 << 21) - 1;
+		return ((x & kMask) << 42) | ((y & kMask) << 21) | (z & kMask);
+	}
+
+	std::unordered_map<uint64_t, std::vector<cif::point>> m_cells;
+};
+
+cif::datablock selectResidues(const cif::datablock &db, const Selection &selection, int verbose)
+{
+	using residue_key = std::tuple<std::string, int>;
+
+	auto &atom_site = db["atom_site"];
+
+	// The CA atoms of all polymer residues, of all models
+	std::vector<std::tuple<residue_key, cif::point>> calphas;
+	CellGrid selected;
+	bool empty = true;
+
+	for (auto row : atom_site)
+	{
+		if (row["label_seq_id"].empty() or row["label_atom_id"].as<std::string>() != "CA")
+			continue;
+
+		residue_key key{ row["label_asym_id"].as<std::string>(), row["label_seq_id"].as<int>() };
+		cif::point pt{ row["Cartn_x"].as<float>(), row["Cartn_y"].as<float>(), row["Cartn_z"].as<float>() };
+
+		calphas.emplace_back(key, pt);
+
+		if (isSelected(selection, std::get<0>(key), std::get<1>(key)))
+		{
+			selected.add(pt);
+			empty = false;
+		}
+	}
+
+	if (empty)
+		throw std::runtime_error("The selection does not contain any residue");
+
+	// The residues within reach of the selection, and their neighbours
+	std::set<residue_key> keep;
+
+	for (auto &[key, pt] : calphas)
+	{
+		auto &[asymID, seqID] = key;
+
+		if (isSelected(selection, asymID, seqID) or selected.near(pt))
+		{
+			for (int i = -kContextResidues; i <= kContextResidues; ++i)
+				keep.emplace(asymID, seqID + i);
+		}
+	}
+
+	if (verbose > 0)
+		std::cerr << "Keeping " << keep.size() << " of " << calphas.size() << " residues for the selection" << std::endl;
+
+	// Non-polymer atoms, ligands and waters, are all kept. They are cheap
+	// compared to the polymers, and pdbx_nonpoly_scheme and struct_conn
+	// refer to them. Links to polymer residues that are removed are
+	// dropped from struct_conn.
+	auto kept = [&keep](cif::row_handle row, const char *asymItem, const char *seqItem)
+	{
+		return row[seqItem].empty() or
+		       keep.count({ row[asymItem].as<std::string>(), row[seqItem].as<int>() });
+	};
+
+	cif::datablock result(db.name());
+	result.set_validator(db.get_validator());
+
+	for (auto &cat : db)
+	{
+		if (cat.name() == "atom_site")
+		{
+			auto &dst = result["atom_site"];
+
+			for (auto row : cat)
+			{
+				if (kept(row, "label_asym_id", "label_seq_id"))
+					dst.emplace(row);
+			}
+		}
+		else if (cat.name() == "struct_conn")
+		{
+			auto &dst = result["struct_conn"];
+
+			for (auto row : cat)
+			{
+				if (kept(row, "ptnr1_label_asym_id", "ptnr1_label_seq_id") and
+					kept(row, "ptnr2_label_asym_id", "ptnr2_label_seq_id"))
+				{
+					dst.emplace(row);
+				}
+			}
+		}
+		else
+			result.push_back(cat);
+	}
+
+	return result;
+}
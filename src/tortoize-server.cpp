@@ -0,0 +1,1383 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ * 
+ * Copyright (c) 2020 NKI/AVL, Netherlands Cancer Institute
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "tortoize.hpp"
+#include "tortoize-json.hpp"
+#include "tortoize-server.hpp"
+#include "revision.hpp"
+
+#include <zeep/http/daemon.hpp>
+#include <zeep/http/server.hpp>
+#include <zeep/http/html-controller.hpp>
+#include <zeep/http/rest-controller.hpp>
+
+#include <zlib.h>
+
+#include <mcfp/mcfp.hpp>
+#include <cif++.hpp>
+
+#include <atomic>
+#include <csignal>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <mutex>
+#include <random>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+using json = zeep::json::element;
+
+// --------------------------------------------------------------------
+
+class tortoize_html_controller : public zeep::http::html_controller
+{
+  public:
+	tortoize_html_controller()
+		: zeep::http::html_controller("tortoize")
+	{
+		mount("{css,scripts,fonts,images,favicon}/", &tortoize_html_controller::handle_file);
+		mount("{favicon.ico,browserconfig.xml,manifest.json}", &tortoize_html_controller::handle_file);
+		mount("", &tortoize_html_controller::index);
+	}
+
+	void index(const zeep::http::request& request, const zeep::http::scope& scope, zeep::http::reply& reply)
+	{
+		get_template_processor().create_reply_from_template("index", scope, reply);
+	}
+};
+
+// --------------------------------------------------------------------
+
+// A read-only streambuf on top of uploaded data
+
+struct membuf : public std::streambuf
+{
+	membuf(const char *text, size_t length)
+	{
+		char *data = const_cast<char *>(text);
+		this->setg(data, data, data + length);
+	}
+};
+
+// --------------------------------------------------------------------
+// The compound factory is initialised with thread local instances only
+// (see start_server), so a dictionary pushed here is only visible to the
+// worker thread handling the current request. This guard parses the
+// uploaded dictionary directly from memory, no temporary files are
+// needed, and pops it again when the request is done.
+
+class dictionary_scope
+{
+  public:
+	dictionary_scope(const char *data, size_t length)
+	{
+		if (length > 0)
+		{
+			membuf buffer(data, length);
+			cif::gzio::istream in(&buffer);
+
+			cif::file dictFile(in);
+			if (dictFile.empty())
+				throw std::runtime_error("Invalid dictionary file");
+
+			cif::compound_factory::instance().push_dictionary(dictFile);
+			m_pushed = true;
+		}
+	}
+
+	dictionary_scope(const std::string &dict)
+		: dictionary_scope(dict.data(), dict.length())
+	{
+	}
+
+	dictionary_scope(const zeep::http::file_param &dict)
+		: dictionary_scope(dict.data, dict.length)
+	{
+	}
+
+	~dictionary_scope()
+	{
+		if (m_pushed)
+			cif::compound_factory::instance().pop_dictionary();
+	}
+
+	dictionary_scope(const dictionary_scope &) = delete;
+	dictionary_scope &operator=(const dictionary_scope &) = delete;
+
+  private:
+	bool m_pushed = false;
+};
+
+// --------------------------------------------------------------------
+// Minimal reader for (ustar and GNU) tar archives, returns the name and
+// contents of the regular files in the archive. The sizes in the headers
+// are not trusted, the archive is rejected when the extracted data would
+// exceed \a maxSize bytes.
+
+std::vector<std::pair<std::string, std::string>> read_tar(std::istream &in, size_t maxSize)
+{
+	std::vector<std::pair<std::string, std::string>> result;
+	std::string longName;
+	size_t total = 0;
+
+	char header[512];
+	while (in.read(header, sizeof(header)))
+	{
+		if (header[0] == 0) // end of archive
+			break;
+
+		std::string name(header, strnlen(header, 100));
+		std::string prefix(header + 345, strnlen(header + 345, 155));
+		if (not prefix.empty() and std::string(header + 257, 5) == "ustar")
+			name = prefix + '/' + name;
+
+		size_t size = std::strtoull(std::string(header + 124, 12).c_str(), nullptr, 8);
+		char type = header[156];
+
+		if (size > maxSize - total)
+			throw std::runtime_error("The contents of the tar archive exceed the maximum upload size");
+		total += size;
+
+		std::string content(size, 0);
+		if (not in.read(content.data(), size))
+			throw std::runtime_error("Truncated tar archive");
+		in.ignore((512 - size % 512) % 512);
+
+		if (type == 'L') // GNU long name for the next entry
+		{
+			longName.assign(content.c_str());
+			continue;
+		}
+
+		if (not longName.empty())
+		{
+			name = longName;
+			longName.clear();
+		}
+
+		if (type == '0' or type == 0)
+			result.emplace_back(name, std::move(content));
+	}
+
+	return result;
+}
+
+// Check for the ustar magic in the first block of \a data, after decompression
+
+bool is_tar(const char *data, size_t length)
+{
+	membuf buffer(data, length);
+	cif::gzio::istream in(&buffer);
+
+	char header[512];
+	return in.read(header, sizeof(header)) and std::string(header + 257, 5) == "ustar";
+}
+
+// --------------------------------------------------------------------
+// Compression of replies. JSON is written straight into a zlib deflate
+// stream, the uncompressed text is never stored as a whole.
+
+enum class content_encoding
+{
+	identity,
+	gzip,
+	deflate
+};
+
+content_encoding negotiate_encoding(const std::string &acceptEncoding)
+{
+	bool gzip = false, deflate = false;
+
+	std::string::size_type b = 0;
+	while (b < acceptEncoding.length())
+	{
+		auto e = acceptEncoding.find(',', b);
+		if (e == std::string::npos)
+			e = acceptEncoding.length();
+
+		std::string coding = acceptEncoding.substr(b, e - b);
+		b = e + 1;
+
+		std::string params;
+		if (auto sc = coding.find(';'); sc != std::string::npos)
+		{
+			params = coding.substr(sc + 1);
+			coding.erase(sc);
+		}
+
+		coding.erase(0, coding.find_first_not_of(" \t"));
+		coding.erase(coding.find_last_not_of(" \t") + 1);
+
+		// a q-value of zero means not acceptable
+		static const std::regex kQZeroRx(R"(\s*q\s*=\s*0(\.0*)?\s*)");
+		if (std::regex_match(params, kQZeroRx))
+			continue;
+
+		if (cif::iequals(coding, "gzip") or cif::iequals(coding, "x-gzip"))
+			gzip = true;
+		else if (cif::iequals(coding, "deflate"))
+			deflate = true;
+	}
+
+	return gzip ? content_encoding::gzip : deflate ? content_encoding::deflate : content_encoding::identity;
+}
+
+class deflate_streambuf : public std::streambuf
+{
+  public:
+	deflate_streambuf(std::string &out, content_encoding encoding)
+		: m_out(out)
+	{
+		// window bits 15 gives the zlib format used for 'deflate', adding 16 writes gzip
+		int windowBits = encoding == content_encoding::gzip ? 15 + 16 : 15;
+		if (deflateInit2(&m_zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			throw std::runtime_error("Could not initialise zlib");
+
+		setp(m_in, m_in + sizeof(m_in));
+	}
+
+	~deflate_streambuf()
+	{
+		deflateEnd(&m_zstream);
+	}
+
+	deflate_streambuf(const deflate_streambuf &) = delete;
+	deflate_streambuf &operator=(const deflate_streambuf &) = delete;
+
+	/// Flush the remaining data and write the trailer
+	void finish()
+	{
+		compress(Z_FINISH);
+	}
+
+  protected:
+	int_type overflow(int_type ch) override
+	{
+		compress(Z_NO_FLUSH);
+
+		if (not traits_type::eq_int_type(ch, traits_type::eof()))
+		{
+			*pptr() = traits_type::to_char_type(ch);
+			pbump(1);
+		}
+
+		return traits_type::not_eof(ch);
+	}
+
+  private:
+	void compress(int flush)
+	{
+		m_zstream.next_in = reinterpret_cast<Bytef *>(pbase());
+		m_zstream.avail_in = static_cast<uInt>(pptr() - pbase());
+
+		int err;
+		do
+		{
+			m_zstream.next_out = reinterpret_cast<Bytef *>(m_buffer);
+			m_zstream.avail_out = sizeof(m_buffer);
+
+			err = deflate(&m_zstream, flush);
+			if (err == Z_STREAM_ERROR)
+				throw std::runtime_error("Error compressing reply");
+
+			m_out.append(m_buffer, sizeof(m_buffer) - m_zstream.avail_out);
+		} while (m_zstream.avail_out == 0 or (flush == Z_FINISH and err != Z_STREAM_END));
+
+		setp(m_in, m_in + sizeof(m_in));
+	}
+
+	std::string &m_out;
+	z_stream m_zstream{};
+	char m_in[16384];
+	char m_buffer[16384];
+};
+
+// The encoding accepted by the client of the request currently handled
+// by this thread, set in tortoize_rest_controller::handle_request.
+thread_local content_encoding t_encoding = content_encoding::identity;
+
+zeep::http::reply make_reply(const json &data, ProfileSink *profile = nullptr)
+{
+	StageTimer timer(profile, Stage::Serialize);
+
+	zeep::http::reply rep(zeep::http::ok);
+
+	if (t_encoding == content_encoding::identity)
+		rep.set_content(data);
+	else
+	{
+		std::string content;
+
+		deflate_streambuf buffer(content, t_encoding);
+		std::ostream os(&buffer);
+		os << data;
+		os.flush();
+		buffer.finish();
+
+		rep.set_content(content, "application/json");
+		rep.set_header("Content-Encoding", t_encoding == content_encoding::gzip ? "gzip" : "deflate");
+		rep.set_header("Vary", "Accept-Encoding");
+	}
+
+	return rep;
+}
+
+bool is_true(const std::string &s)
+{
+	return not s.empty() and s != "0" and not cif::iequals(s, "false") and not cif::iequals(s, "no");
+}
+
+// --------------------------------------------------------------------
+// Metrics, exported in the Prometheus text format. Everything recorded
+// while handling requests uses relaxed atomics, no locking is needed.
+
+class histogram
+{
+  public:
+	histogram(std::vector<double> bounds)
+		: m_bounds(std::move(bounds))
+		, m_counts(m_bounds.size() + 1)
+	{
+	}
+
+	histogram(const histogram &) = delete;
+	histogram &operator=(const histogram &) = delete;
+
+	void observe(double value)
+	{
+		auto i = std::lower_bound(m_bounds.begin(), m_bounds.end(), value) - m_bounds.begin();
+		m_counts[i].fetch_add(1, std::memory_order_relaxed);
+
+		// there is no fetch_add for atomic doubles before C++20
+		double sum = m_sum.load(std::memory_order_relaxed);
+		while (not m_sum.compare_exchange_weak(sum, sum + value, std::memory_order_relaxed))
+			;
+	}
+
+	void write(std::ostream &os, const std::string &name, const std::string &labels) const
+	{
+		std::string sep = labels.empty() ? "" : ",";
+
+		uint64_t cumulative = 0;
+		for (size_t i = 0; i < m_bounds.size(); ++i)
+		{
+			cumulative += m_counts[i].load(std::memory_order_relaxed);
+			os << name << "_bucket{" << labels << sep << "le=\"" << m_bounds[i] << "\"} " << cumulative << '\n';
+		}
+
+		cumulative += m_counts.back().load(std::memory_order_relaxed);
+		os << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << cumulative << '\n'
+		   << name << "_sum{" << labels << "} " << m_sum.load(std::memory_order_relaxed) << '\n'
+		   << name << "_count{" << labels << "} " << cumulative << '\n';
+	}
+
+  private:
+	std::vector<double> m_bounds;
+	std::vector<std::atomic<uint64_t>> m_counts;
+	std::atomic<double> m_sum = 0;
+};
+
+size_t resident_set_size()
+{
+	size_t result = 0;
+
+#if defined(__linux__)
+	std::ifstream statm("/proc/self/statm");
+	size_t size, resident;
+	if (statm >> size >> resident)
+		result = resident * sysconf(_SC_PAGESIZE);
+#endif
+
+	return result;
+}
+
+class server_metrics : public ProfileSink
+{
+  public:
+	enum class endpoint
+	{
+		tortoize,
+		batch,
+		job,
+		other
+	};
+
+	static constexpr size_t kEndpointCount = 4;
+	static constexpr size_t kStageCount = static_cast<size_t>(Stage::Serialize) + 1;
+
+	server_metrics()
+	{
+		for (auto &h : m_request_duration)
+			h = std::make_unique<histogram>(kDurationBounds);
+
+		for (auto &h : m_stage_duration)
+			h = std::make_unique<histogram>(kDurationBounds);
+	}
+
+	static endpoint endpoint_for(std::string path)
+	{
+		if (auto q = path.find('?'); q != std::string::npos)
+			path.erase(q);
+
+		if (not path.empty() and path.front() == '/')
+			path.erase(0, 1);
+
+		if (path == "tortoize")
+			return endpoint::tortoize;
+		if (path == "batch")
+			return endpoint::batch;
+		if (path.compare(0, 3, "job") == 0)
+			return endpoint::job;
+		return endpoint::other;
+	}
+
+	void record(Stage stage, std::chrono::nanoseconds wall, std::chrono::nanoseconds cpu) override
+	{
+		m_stage_duration[static_cast<size_t>(stage)]->observe(std::chrono::duration<double>(wall).count());
+	}
+
+	void record_request(endpoint ep, size_t uploadSize, std::chrono::nanoseconds duration)
+	{
+		m_requests[static_cast<size_t>(ep)].fetch_add(1, std::memory_order_relaxed);
+		m_request_duration[static_cast<size_t>(ep)]->observe(std::chrono::duration<double>(duration).count());
+
+		if (uploadSize > 0)
+			m_upload_size.observe(static_cast<double>(uploadSize));
+	}
+
+	void record_rejected(const char *reason)
+	{
+		if (strcmp(reason, "backlog") == 0)
+			m_rejected_backlog.fetch_add(1, std::memory_order_relaxed);
+		else
+			m_rejected_size.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void write(std::ostream &os, size_t active, size_t pending, size_t jobsQueued, size_t jobsRunning) const
+	{
+		static const char *const kEndpointNames[kEndpointCount] = { "tortoize", "batch", "job", "other" };
+
+		os << "# HELP tortoize_requests_total Number of requests handled\n"
+		   << "# TYPE tortoize_requests_total counter\n";
+		for (size_t i = 0; i < kEndpointCount; ++i)
+			os << "tortoize_requests_total{endpoint=\"" << kEndpointNames[i] << "\"} " << m_requests[i].load(std::memory_order_relaxed) << '\n';
+
+		os << "# HELP tortoize_requests_rejected_total Number of requests rejected\n"
+		   << "# TYPE tortoize_requests_rejected_total counter\n"
+		   << "tortoize_requests_rejected_total{reason=\"backlog\"} " << m_rejected_backlog.load(std::memory_order_relaxed) << '\n'
+		   << "tortoize_requests_rejected_total{reason=\"upload-size\"} " << m_rejected_size.load(std::memory_order_relaxed) << '\n';
+
+		os << "# HELP tortoize_request_duration_seconds Time spent handling a request\n"
+		   << "# TYPE tortoize_request_duration_seconds histogram\n";
+		for (size_t i = 0; i < kEndpointCount; ++i)
+			m_request_duration[i]->write(os, "tortoize_request_duration_seconds", std::string("endpoint=\"") + kEndpointNames[i] + '"');
+
+		os << "# HELP tortoize_upload_bytes Size of the uploaded data\n"
+		   << "# TYPE tortoize_upload_bytes histogram\n";
+		m_upload_size.write(os, "tortoize_upload_bytes", "");
+
+		os << "# HELP tortoize_stage_duration_seconds Time spent in each stage of a calculation\n"
+		   << "# TYPE tortoize_stage_duration_seconds histogram\n";
+		for (size_t i = 0; i < kStageCount; ++i)
+			m_stage_duration[i]->write(os, "tortoize_stage_duration_seconds", "stage=\"" + to_string(static_cast<Stage>(i)) + '"');
+
+		os << "# HELP tortoize_calculations_in_flight Number of synchronous calculations running\n"
+		   << "# TYPE tortoize_calculations_in_flight gauge\n"
+		   << "tortoize_calculations_in_flight " << active << '\n'
+		   << "# HELP tortoize_calculations_pending Number of synchronous calculations waiting for a slot\n"
+		   << "# TYPE tortoize_calculations_pending gauge\n"
+		   << "tortoize_calculations_pending " << pending << '\n'
+		   << "# HELP tortoize_jobs Number of background jobs\n"
+		   << "# TYPE tortoize_jobs gauge\n"
+		   << "tortoize_jobs{status=\"queued\"} " << jobsQueued << '\n'
+		   << "tortoize_jobs{status=\"running\"} " << jobsRunning << '\n'
+		   << "# HELP tortoize_resident_memory_bytes Resident set size of the process\n"
+		   << "# TYPE tortoize_resident_memory_bytes gauge\n"
+		   << "tortoize_resident_memory_bytes " << resident_set_size() << '\n';
+	}
+
+  private:
+	inline static const std::vector<double> kDurationBounds{
+		0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60
+	};
+
+	std::atomic<uint64_t> m_requests[kEndpointCount] = {};
+	std::atomic<uint64_t> m_rejected_backlog = 0, m_rejected_size = 0;
+
+	std::unique_ptr<histogram> m_request_duration[kEndpointCount];
+	std::unique_ptr<histogram> m_stage_duration[kStageCount];
+
+	histogram m_upload_size{ { 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 } };
+};
+
+// --------------------------------------------------------------------
+// Admission control for the calculations. At most max_active requests
+// are calculated at the same time, up to max_pending more are queued
+// waiting for a slot. Anything beyond that is rejected right away.
+
+class request_gate
+{
+  public:
+	request_gate(size_t maxActive, size_t maxPending)
+		: m_max_active(maxActive)
+		, m_max_pending(maxPending)
+	{
+	}
+
+	request_gate(const request_gate &) = delete;
+	request_gate &operator=(const request_gate &) = delete;
+
+	class ticket
+	{
+	  public:
+		ticket(request_gate &gate)
+			: m_gate(gate)
+		{
+		}
+
+		~ticket()
+		{
+			m_gate.leave();
+		}
+
+		ticket(const ticket &) = delete;
+		ticket &operator=(const ticket &) = delete;
+
+	  private:
+		request_gate &m_gate;
+	};
+
+	/// Wait for a free slot, returns false if the backlog is full
+	bool enter()
+	{
+		std::unique_lock lock(m_mutex);
+
+		if (m_active >= m_max_active and m_pending >= m_max_pending)
+			return false;
+
+		++m_pending;
+		m_cv.wait(lock, [this]
+			{ return m_active < m_max_active; });
+		--m_pending;
+		++m_active;
+
+		return true;
+	}
+
+	/// Take a free slot without waiting, returns false if there is none
+	/// or if other requests are waiting for one
+	bool try_enter()
+	{
+		std::unique_lock lock(m_mutex);
+
+		if (m_active >= m_max_active or m_pending > 0)
+			return false;
+
+		++m_active;
+		return true;
+	}
+
+	std::tuple<size_t, size_t> counts()
+	{
+		std::unique_lock lock(m_mutex);
+		return { m_active, m_pending };
+	}
+
+  private:
+	void leave()
+	{
+		std::unique_lock lock(m_mutex);
+		--m_active;
+		m_cv.notify_one();
+	}
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	size_t m_max_active, m_max_pending;
+	size_t m_active = 0, m_pending = 0;
+};
+
+// --------------------------------------------------------------------
+// A bounded queue of background jobs. Jobs are processed by a fixed
+// number of worker threads, finished jobs are kept around for the
+// expiry period so the results can be fetched.
+
+class job_queue
+{
+  public:
+	job_queue(size_t threads, size_t maxJobs, std::chrono::seconds expiry, ProfileSink *profile,
+		std::shared_ptr<const DataTable> tables)
+		: m_max_jobs(maxJobs)
+		, m_profile(profile)
+		, m_tables(std::move(tables))
+		, m_expiry(expiry)
+		, m_rng(std::random_device{}())
+	{
+		for (size_t i = 0; i < threads; ++i)
+			m_threads.emplace_back(&job_queue::run, this);
+	}
+
+	~job_queue()
+	{
+		{
+			std::unique_lock lock(m_mutex);
+			m_stop = true;
+			m_cv.notify_all();
+		}
+
+		for (auto &t : m_threads)
+			t.join();
+	}
+
+	job_queue(const job_queue &) = delete;
+	job_queue &operator=(const job_queue &) = delete;
+
+	/// Submit a new job, returns the ID of the job or an empty string
+	/// if the queue is full
+	std::string submit(const zeep::http::file_param &data, const zeep::http::file_param &dict, bool summaryOnly, ScoreType only)
+	{
+		std::unique_lock lock(m_mutex);
+
+		expire();
+
+		// Queued, running and finished jobs all count against the limit,
+		// to make room the oldest finished job is dropped before expiry
+		if (m_jobs.size() >= m_max_jobs and not drop_oldest_finished())
+			return {};
+
+		std::string id;
+		do
+		{
+			std::ostringstream os;
+			os << std::hex << std::setfill('0') << std::setw(16) << m_rng() << std::setw(16) << m_rng();
+			id = os.str();
+		} while (m_jobs.count(id));
+
+		auto j = std::make_shared<job>();
+		j->id = id;
+		// The job outlives the request, so here the upload is copied
+		j->data.assign(data.data, data.length);
+		j->dict.assign(dict.data, dict.length);
+		j->summary_only = summaryOnly;
+		j->only = only;
+
+		m_jobs.emplace(id, j);
+		m_queue.push_back(j);
+		m_cv.notify_one();
+
+		return id;
+	}
+
+	/// Return the status for job \a id, or null if there is no such job
+	json status(const std::string &id)
+	{
+		std::unique_lock lock(m_mutex);
+
+		expire();
+
+		auto i = m_jobs.find(id);
+		if (i == m_jobs.end())
+			return {};
+
+		auto &j = *i->second;
+
+		json result{
+			{ "id", j.id },
+			{ "status", to_string(j.status) },
+			{ "progress",
+				{ { "models-done", j.models_done },
+					{ "models-total", j.models_total } } }
+		};
+
+		if (j.status == job_status::failed)
+			result["error"] = j.error;
+
+		return result;
+	}
+
+	/// Return the number of queued and running jobs
+	std::tuple<size_t, size_t> counts()
+	{
+		std::unique_lock lock(m_mutex);
+		return { m_queue.size(), m_running };
+	}
+
+	/// Return the result for job \a id, or null if it is not available
+	json result(const std::string &id)
+	{
+		std::unique_lock lock(m_mutex);
+
+		auto i = m_jobs.find(id);
+		if (i == m_jobs.end() or i->second->status != job_status::done)
+			return {};
+
+		return i->second->result;
+	}
+
+  private:
+	enum class job_status
+	{
+		queued,
+		running,
+		done,
+		failed
+	};
+
+	static std::string to_string(job_status status)
+	{
+		switch (status)
+		{
+			case job_status::queued: return "queued";
+			case job_status::running: return "running";
+			case job_status::done: return "done";
+			case job_status::failed: return "failed";
+		}
+
+		return {};
+	}
+
+	struct job
+	{
+		std::string id;
+		job_status status = job_status::queued;
+		std::string data, dict;
+		bool summary_only = false;
+		ScoreType only = ScoreType::both;
+		size_t models_done = 0, models_total = 0;
+		json result;
+		std::string error;
+		std::chrono::steady_clock::time_point finished;
+	};
+
+	// remove finished jobs that have expired, called with the lock held
+	void expire()
+	{
+		auto now = std::chrono::steady_clock::now();
+
+		for (auto i = m_jobs.begin(); i != m_jobs.end();)
+		{
+			auto status = i->second->status;
+			if ((status == job_status::done or status == job_status::failed) and now - i->second->finished > m_expiry)
+				i = m_jobs.erase(i);
+			else
+				++i;
+		}
+	}
+
+	// remove the finished job that finished first, called with the lock
+	// held. Returns false if there is no finished job.
+	bool drop_oldest_finished()
+	{
+		auto oldest = m_jobs.end();
+
+		for (auto i = m_jobs.begin(); i != m_jobs.end(); ++i)
+		{
+			auto status = i->second->status;
+			if (status != job_status::done and status != job_status::failed)
+				continue;
+
+			if (oldest == m_jobs.end() or i->second->finished < oldest->second->finished)
+				oldest = i;
+		}
+
+		if (oldest == m_jobs.end())
+			return false;
+
+		m_jobs.erase(oldest);
+		return true;
+	}
+
+	void run()
+	{
+		for (;;)
+		{
+			std::shared_ptr<job> j;
+			std::string data, dict;
+
+			{
+				std::unique_lock lock(m_mutex);
+				m_cv.wait(lock, [this]
+					{ return m_stop or not m_queue.empty(); });
+
+				if (m_stop)
+					break;
+
+				j = m_queue.front();
+				m_queue.pop_front();
+				j->status = job_status::running;
+				++m_running;
+
+				// The upload is owned by this worker from here on, it is
+				// released as soon as the job is done
+				data = std::move(j->data);
+				dict = std::move(j->dict);
+			}
+
+			json result;
+			std::string error;
+
+			try
+			{
+				dictionary_scope dictScope(dict);
+
+				membuf buffer(data.data(), data.length());
+				cif::gzio::istream in(&buffer);
+
+				StageTimer parseTimer(m_profile, Stage::Parse);
+				cif::file f = cif::pdb::read(in);
+				parseTimer.stop();
+
+				if (f.empty())
+					throw std::runtime_error("Invalid mmCIF or PDB file");
+
+				TortoizeOptions options;
+				options.summaryOnly = j->summary_only;
+				options.only = j->only;
+				options.profile = m_profile;
+				options.tables = m_tables;
+				options.verbose = cif::VERBOSE;
+				options.progress = [this, j](size_t done, size_t total)
+				{
+					std::unique_lock lock(m_mutex);
+					j->models_done = done;
+					j->models_total = total;
+				};
+
+				result = tortoize_calculate(f, options);
+			}
+			catch (const std::exception &ex)
+			{
+				error = ex.what();
+			}
+
+			data.clear();
+			data.shrink_to_fit();
+			dict.clear();
+			dict.shrink_to_fit();
+
+			std::unique_lock lock(m_mutex);
+
+			--m_running;
+
+			j->status = error.empty() ? job_status::done : job_status::failed;
+			j->result = std::move(result);
+			j->error = error;
+			j->finished = std::chrono::steady_clock::now();
+		}
+	}
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	bool m_stop = false;
+
+	size_t m_max_jobs, m_running = 0;
+	ProfileSink *m_profile;
+	std::shared_ptr<const DataTable> m_tables;
+	std::chrono::seconds m_expiry;
+	std::mt19937_64 m_rng;
+
+	std::map<std::string, std::shared_ptr<job>> m_jobs;
+	std::deque<std::shared_ptr<job>> m_queue;
+	std::vector<std::thread> m_threads;
+};
+
+// --------------------------------------------------------------------
+
+class tortoize_rest_controller : public zeep::http::rest_controller
+{
+  public:
+	tortoize_rest_controller(size_t threads, size_t maxPending, size_t maxUploadSize,
+		size_t jobThreads, size_t maxJobs, std::chrono::seconds jobExpiry)
+		: zeep::http::rest_controller("")
+		, m_threads(threads)
+		, m_gate(threads, maxPending)
+		, m_max_upload_size(maxUploadSize)
+		, m_tables(loadDataTable())
+		, m_jobs(jobThreads, maxJobs, jobExpiry, &m_metrics, m_tables)
+	{
+		map_post_request("tortoize", &tortoize_rest_controller::calculate, "data", "dict", "summary", "select", "only");
+
+		map_post_request("job", &tortoize_rest_controller::submit_job, "data", "dict", "summary", "only");
+		map_get_request("job/{id}", &tortoize_rest_controller::get_job_status, "id");
+		map_get_request("job/{id}/result", &tortoize_rest_controller::get_job_result, "id");
+
+		map_post_request("batch", &tortoize_rest_controller::calculate_batch, "data", "dict", "summary", "only");
+
+		map_get_request("metrics", &tortoize_rest_controller::get_metrics);
+	}
+
+	bool handle_request(zeep::http::request &req, zeep::http::reply &rep) override
+	{
+		t_encoding = negotiate_encoding(req.get_header("Accept-Encoding"));
+
+		auto start = std::chrono::steady_clock::now();
+		auto ep = server_metrics::endpoint_for(req.get_uri());
+
+		bool result = dispatch(req, rep);
+
+		if (ep != server_metrics::endpoint::other)
+		{
+			size_t uploadSize = req.get_method() == "POST" ? req.get_payload().length() : 0;
+			m_metrics.record_request(ep, uploadSize, std::chrono::steady_clock::now() - start);
+		}
+
+		return result;
+	}
+
+	zeep::http::reply get_metrics()
+	{
+		auto [active, pending] = m_gate.counts();
+		auto [jobsQueued, jobsRunning] = m_jobs.counts();
+
+		std::ostringstream os;
+		m_metrics.write(os, active, pending, jobsQueued, jobsRunning);
+
+		zeep::http::reply rep(zeep::http::ok);
+		rep.set_content(os.str(), "text/plain; version=0.0.4");
+		return rep;
+	}
+
+	// The uploads are not copied, the data is decompressed while it is
+	// parsed directly from the request payload.
+
+	zeep::http::reply calculate(const zeep::http::file_param &file, const zeep::http::file_param &dict, const std::string &summary,
+		const std::string &select, const std::string &only)
+	{
+		dictionary_scope dictScope(dict);
+
+		membuf buffer(file.data, file.length);
+		cif::gzio::istream in(&buffer);
+
+		StageTimer parseTimer(&m_metrics, Stage::Parse);
+		cif::file f = cif::pdb::read(in);
+		parseTimer.stop();
+
+		if (f.empty())
+			throw std::runtime_error("Invalid mmCIF or PDB file");
+
+		TortoizeOptions options;
+		options.summaryOnly = is_true(summary);
+		options.profile = &m_metrics;
+		options.tables = m_tables;
+		options.verbose = cif::VERBOSE;
+
+		if (not select.empty())
+			options.selection = parseSelection(select);
+
+		if (not only.empty())
+			options.only = parseScoreType(only);
+
+		return make_reply(tortoize_calculate(f, options), &m_metrics);
+	}
+
+	// --------------------------------------------------------------------
+	// Batch calculation. The data parameter can be specified multiple
+	// times and each upload can be a tar archive containing structures.
+	// All structures share the same optional dictionary and are processed
+	// in parallel.
+
+	zeep::http::reply calculate_batch(const std::vector<zeep::http::file_param> &files, const zeep::http::file_param &dict, const std::string &summary,
+		const std::string &only)
+	{
+		TortoizeOptions options;
+		options.summaryOnly = is_true(summary);
+		options.profile = &m_metrics;
+		options.tables = m_tables;
+		options.verbose = cif::VERBOSE;
+
+		if (not only.empty())
+			options.only = parseScoreType(only);
+
+		struct entry
+		{
+			std::string name;
+			const char *data;
+			size_t length;
+		};
+
+		// The entries are in the order of the uploads, the members of an
+		// archive in their order in the archive. A deque keeps the extracted
+		// data in place while it grows.
+		std::vector<entry> entries;
+		std::deque<std::string> extracted;
+
+		for (auto &file : files)
+		{
+			if (is_tar(file.data, file.length))
+			{
+				membuf buffer(file.data, file.length);
+				cif::gzio::istream in(&buffer);
+
+				for (auto &[name, content] : read_tar(in, m_max_upload_size))
+				{
+					auto &data = extracted.emplace_back(std::move(content));
+					entries.push_back({ name, data.data(), data.length() });
+				}
+			}
+			else
+				entries.push_back({ file.filename, file.data, file.length });
+		}
+
+		std::vector<json> results(entries.size());
+		std::atomic<size_t> next = 0;
+
+		auto worker = [&]()
+		{
+			for (size_t i = next++; i < entries.size(); i = next++)
+			{
+				auto &e = entries[i];
+				json &result = results[i];
+
+				result["name"] = e.name;
+
+				try
+				{
+					membuf buffer(e.data, e.length);
+					cif::gzio::istream in(&buffer);
+
+					StageTimer parseTimer(&m_metrics, Stage::Parse);
+					cif::file f = cif::pdb::read(in);
+					parseTimer.stop();
+
+					if (f.empty())
+						throw std::runtime_error("Invalid mmCIF or PDB file");
+
+					result["model"] = tortoize_calculate(f, options)["model"];
+				}
+				catch (const std::exception &ex)
+				{
+					result["error"] = ex.what();
+				}
+			}
+		};
+
+		// The dictionary needs to be pushed in each thread, doing it here
+		// first also validates it before any thread is started.
+		dictionary_scope dictScope(dict);
+
+		size_t nrOfThreads = std::min(m_threads, entries.size());
+
+		// The request itself holds one calculation slot. Additional workers
+		// each take a slot that is free right now, so concurrent batches
+		// stay within the --threads limit.
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < nrOfThreads and m_gate.try_enter(); ++i)
+		{
+			// the slot is released when the worker is done, or when it
+			// could not be started
+			auto ticket = std::make_shared<request_gate::ticket>(m_gate);
+
+			threads.emplace_back([&, ticket]()
+				{
+					try
+					{
+						dictionary_scope dictScope(dict);
+						worker();
+					}
+					catch (...)
+					{
+						// the remaining entries are picked up by the other threads
+					} });
+		}
+
+		worker();
+
+		for (auto &t : threads)
+			t.join();
+
+		json data;
+		for (auto &result : results)
+			data["structures"].push_back(std::move(result));
+
+		return make_reply(data, &m_metrics);
+	}
+
+	// --------------------------------------------------------------------
+	// The asynchronous job API
+
+	zeep::http::reply submit_job(const zeep::http::file_param &file, const zeep::http::file_param &dict, const std::string &summary,
+		const std::string &only)
+	{
+		auto id = m_jobs.submit(file, dict, is_true(summary), only.empty() ? ScoreType::both : parseScoreType(only));
+		if (id.empty())
+		{
+			auto rep = zeep::http::reply::stock_reply(zeep::http::service_unavailable);
+			rep.set_header("Retry-After", "30");
+			return rep;
+		}
+
+		zeep::http::reply rep(zeep::http::accepted);
+		rep.set_content(m_jobs.status(id));
+		return rep;
+	}
+
+	zeep::http::reply get_job_status(const std::string &id)
+	{
+		json status = m_jobs.status(id);
+		if (status.is_null())
+			return zeep::http::reply::stock_reply(zeep::http::not_found);
+
+		zeep::http::reply rep(zeep::http::ok);
+		rep.set_content(status);
+		return rep;
+	}
+
+	zeep::http::reply get_job_result(const std::string &id)
+	{
+		json status = m_jobs.status(id);
+		if (status.is_null())
+			return zeep::http::reply::stock_reply(zeep::http::not_found);
+
+		zeep::http::reply rep(zeep::http::ok);
+
+		json result = m_jobs.result(id);
+		if (result.is_null())
+		{
+			// not finished yet, or failed
+			rep.set_status(status["status"].as<std::string>() == "failed" ? zeep::http::internal_server_error : zeep::http::accepted);
+			rep.set_content(status);
+		}
+		else
+			rep = make_reply(result, &m_metrics);
+
+		return rep;
+	}
+
+  private:
+	bool dispatch(zeep::http::request &req, zeep::http::reply &rep)
+	{
+		if (req.get_method() != "POST")
+			return zeep::http::rest_controller::handle_request(req, rep);
+
+		if (req.get_payload().length() > m_max_upload_size)
+		{
+			m_metrics.record_rejected("upload-size");
+			rep = zeep::http::reply::stock_reply(zeep::http::request_entity_too_large);
+			return true;
+		}
+
+		// Only the synchronous calculations go through the gate
+		if (not is_calculation(req))
+			return zeep::http::rest_controller::handle_request(req, rep);
+
+		if (not m_gate.enter())
+		{
+			m_metrics.record_rejected("backlog");
+			rep = zeep::http::reply::stock_reply(zeep::http::service_unavailable);
+			rep.set_header("Retry-After", "5");
+			return true;
+		}
+
+		request_gate::ticket ticket(m_gate);
+		return zeep::http::rest_controller::handle_request(req, rep);
+	}
+
+	static bool is_calculation(const zeep::http::request &req)
+	{
+		std::string path = req.get_uri();
+
+		auto q = path.find('?');
+		if (q != std::string::npos)
+			path.erase(q);
+
+		if (not path.empty() and path.front() == '/')
+			path.erase(0, 1);
+
+		return path == "tortoize" or path == "batch";
+	}
+
+	size_t m_threads;
+	server_metrics m_metrics;
+	request_gate m_gate;
+	size_t m_max_upload_size;
+	std::shared_ptr<const DataTable> m_tables; // shared by all requests
+	job_queue m_jobs;
+};
+
+// zeep::http::daemon::run_foreground always uses a single HTTP thread,
+// this version runs \a nrOfThreads like the daemon does and stops on
+// SIGINT, SIGHUP, SIGQUIT or SIGTERM.
+
+int run_foreground(const std::function<zeep::http::server *()> &factory, const std::string &address, uint16_t port, size_t nrOfThreads)
+{
+	// The server threads should not receive the signals
+	sigset_t newMask, oldMask;
+	sigfillset(&newMask);
+	pthread_sigmask(SIG_BLOCK, &newMask, &oldMask);
+
+	std::unique_ptr<zeep::http::server> server(factory());
+	server->bind(address, port);
+
+	std::thread t([&server, nrOfThreads]()
+		{ server->run(static_cast<int>(nrOfThreads)); });
+
+	pthread_sigmask(SIG_SETMASK, &oldMask, nullptr);
+
+	sigset_t waitMask;
+	sigemptyset(&waitMask);
+	sigaddset(&waitMask, SIGINT);
+	sigaddset(&waitMask, SIGHUP);
+	sigaddset(&waitMask, SIGQUIT);
+	sigaddset(&waitMask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &waitMask, nullptr);
+
+	int sig = 0;
+	sigwait(&waitMask, &sig);
+
+	server->stop();
+	t.join();
+
+	return 0;
+}
+
+int start_server(int argc, char* argv[])
+{
+	using namespace std::literals;
+	namespace zh = zeep::http;
+
+	// Each worker thread gets its own compound factory, that way the
+	// dictionaries uploaded with a request do not leak into other requests
+	cif::compound_factory::init(true);
+
+	int result = 0;
+
+	auto &config = mcfp::config::instance();
+
+	config.init("tortoize server [options] start|stop|status|reload",
+		mcfp::make_option("help,h", "Display help message"),
+		mcfp::make_option("version", "Print version"),
+		mcfp::make_option("verbose,v", "verbose output"),
+
+		mcfp::make_option<std::string>("address", "0.0.0.0", "External address"),
+		mcfp::make_option<uint16_t>("port", 10350, "Port to listen to"),
+		mcfp::make_option<std::string>("user,u", "www-data", "User to run the daemon"),
+
+		mcfp::make_option<size_t>("threads", std::max(std::thread::hardware_concurrency(), 1U), "Number of calculations to run concurrently"),
+		mcfp::make_option<size_t>("max-pending", 32, "Number of requests that may wait for a free calculation slot, more requests are rejected"),
+		mcfp::make_option<size_t>("max-upload-size", 256, "Maximum size of an upload in megabytes"),
+
+		mcfp::make_option<size_t>("job-threads", 2, "Number of threads processing background jobs"),
+		mcfp::make_option<size_t>("max-jobs", 64, "Maximum number of background jobs kept, queued, running or finished"),
+		mcfp::make_option<size_t>("job-expiry", 3600, "Number of seconds the result of a background job is kept"),
+
+		mcfp::make_option("no-daemon,F", "Do not fork into background"));
+
+	config.parse(argc, argv);
+
+	// --------------------------------------------------------------------
+
+	if (config.has("version"))
+	{
+		write_version_string(std::cout, config.has("verbose"));
+		exit(0);
+	}
+
+	if (config.has("help"))
+	{
+		std::cout << config << std::endl;
+		exit(0);
+	}
+	
+	if (config.operands().empty())
+	{
+		std::cerr << "Missing command, should be one of start, stop, status or reload" << std::endl;
+		exit(1);
+	}
+
+	cif::VERBOSE = config.count("verbose");
+
+	std::string user = config.get<std::string>("user");
+	std::string address = config.get<std::string>("address");
+	uint16_t port = config.get<uint16_t>("port");
+
+	size_t threads = std::max<size_t>(config.get<size_t>("threads"), 1);
+	size_t maxPending = config.get<size_t>("max-pending");
+	size_t maxUploadSize = config.get<size_t>("max-upload-size") * 1024 * 1024;
+
+	// Each waiting request holds an HTTP thread and its upload, so the
+	// backlog is limited to a few requests per calculation slot
+	const size_t kMaxPendingPerThread = 8;
+	if (maxPending > threads * kMaxPendingPerThread)
+	{
+		maxPending = threads * kMaxPendingPerThread;
+		std::cerr << "Limiting max-pending to " << maxPending << " (" << kMaxPendingPerThread << " per thread)" << std::endl;
+	}
+
+	size_t jobThreads = std::max<size_t>(config.get<size_t>("job-threads"), 1);
+	size_t maxJobs = config.get<size_t>("max-jobs");
+	std::chrono::seconds jobExpiry(config.get<size_t>("job-expiry"));
+
+	auto factory = [&]()
+	{
+		auto s = new zeep::http::server();
+
+#if DEBUG
+		s->set_template_processor(new zeep::http::file_based_html_template_processor("docroot"));
+#else
+		s->set_template_processor(new zeep::http::rsrc_based_html_template_processor());
+#endif
+		s->add_controller(new tortoize_rest_controller(threads, maxPending, maxUploadSize, jobThreads, maxJobs, jobExpiry));
+		s->add_controller(new tortoize_html_controller());
+		return s;
+	};
+
+	zh::daemon server(factory, kProjectName);
+
+	// Requests waiting for a calculation slot each occupy an HTTP thread,
+	// one extra thread is left to reject the overflow. Note that the
+	// upload is read before a request can be rejected.
+	size_t httpThreads = threads + maxPending + 1;
+
+	std::string command = config.operands().front();
+
+	if (command == "start")
+	{
+		std::cout << "starting server at http://" << address << ':' << port << '/' << std::endl;
+
+		if (config.has("no-daemon"))
+			result = run_foreground(factory, address, port, httpThreads);
+		else
+			result = server.start(address, port, 1, httpThreads, user);
+	}
+	else if (command == "stop")
+		result = server.stop();
+	else if (command == "status")
+		result = server.status();
+	else if (command == "reload")
+		result = server.reload();
+	else
+	{
+		std::cerr << "Invalid command" << std::endl;
+		result = 1;
+	}
+
+	return result;
+}
@@ -0,0 +1,494 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2020 NKI/AVL, Netherlands Cancer Institute
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Derive new statistics from a set of structures
+
+#include "tortoize.hpp"
+#include "data-table.hpp"
+#include "dihedrals.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <mutex>
+#include <regex>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+// --------------------------------------------------------------------
+// Run \a f for the indices 0 to \a n using \a nrOfThreads threads. The
+// first exception thrown by \a f is rethrown.
+
+template <typename F>
+void parallelFor(size_t n, size_t nrOfThreads, F &&f)
+{
+	std::atomic<size_t> next{ 0 };
+	std::mutex m;
+	std::exception_ptr error;
+
+	auto worker = [&]()
+	{
+		for (;;)
+		{
+			size_t i = next++;
+			if (i >= n)
+				break;
+
+			try
+			{
+				f(i);
+			}
+			catch (...)
+			{
+				std::unique_lock lock(m);
+				if (not error)
+					error = std::current_exception();
+				next = n;
+			}
+		}
+	};
+
+	nrOfThreads = std::min(std::max<size_t>(nrOfThreads, 1), std::max<size_t>(n, 1));
+
+	if (nrOfThreads == 1)
+		worker();
+	else
+	{
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < nrOfThreads; ++i)
+			threads.emplace_back(worker);
+
+		for (auto &t : threads)
+			t.join();
+	}
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+// --------------------------------------------------------------------
+// The tables being trained, the Ramachandran tables first. The layout
+// of the tables, i.e. the compounds, secondary structures and bin
+// spacing, is that of the distributed tables.
+
+class TableTrainer
+{
+  public:
+	/// An angle pair observed for a table
+	struct Observation
+	{
+		uint16_t table;
+		float a1, a2;
+	};
+
+	using Histograms = std::vector<std::vector<uint32_t>>;
+
+	TableTrainer(float binSpacing);
+
+	/// The observations for residue \a i in \a poly
+	void classify(const cif::mm::polymer &poly, size_t i, const PolymerDihedrals &dihedrals,
+		const SecStrAssignment &secstr, int verbose, std::vector<Observation> &observations) const;
+
+	/// Histograms with all counts zero
+	Histograms emptyHistograms() const;
+
+	void add(Histograms &histograms, const Observation &o) const
+	{
+		histograms[o.table][binIndex(m_tables[o.table], o.a1, o.a2)] += 1;
+	}
+
+	/// Store the counts and calculate the mean and sd of each table
+	void finish(Histograms &&histograms, const std::vector<std::vector<Observation>> &observations, size_t nrOfThreads);
+
+	float zscore(const Observation &o) const
+	{
+		return m_tables[o.table].zscore(o.a1, o.a2);
+	}
+
+	bool isTorsion(const Observation &o) const
+	{
+		return o.table >= m_torsionOffset;
+	}
+
+	/// Write the tables. Tables without observations are written with all
+	/// counts zero, a mean of 0 and an sd of 1. Residues scored with such a
+	/// table get a z-score of 0 instead of failing for lack of data.
+	void write(const fs::path &dir, float meanRamachandran, float sdRamachandran, float meanTorsion, float sdTorsion);
+
+  private:
+	/// The grid point nearest to \a a. The interpolation takes the counts
+	/// to be at the grid points, the bins are therefore centred on them.
+	static size_t bin(const Data &d, float a)
+	{
+		return static_cast<size_t>(std::rint((a + 180) / d.binSpacing)) % d.dim;
+	}
+
+	/// The index of the bin for \a a1, \a a2 in the counts of \a d
+	static size_t binIndex(const Data &d, float a1, float a2)
+	{
+		return d.twoDimensional() ? bin(d, a1) * d.dim + bin(d, a2) : bin(d, a1);
+	}
+
+	std::optional<uint16_t> find(bool torsion, const std::string &aa, SecStrType ss) const
+	{
+		auto i = m_index.find({ torsion, aa, ss });
+		if (i == m_index.end())
+			return {};
+		return i->second;
+	}
+
+	void addTable(bool torsion, const std::string &aa, SecStrType ss)
+	{
+		bool d2 = Data::isTwoDimensional(torsion, aa);
+
+		m_index[{ torsion, aa, ss }] = static_cast<uint16_t>(m_tables.size());
+		m_tables.emplace_back(torsion, aa, ss, d2 ? m_binSpacing : std::min(m_binSpacing, 0.5f));
+	}
+
+	float m_binSpacing;
+	std::vector<Data> m_tables;
+	std::vector<size_t> m_observationCounts;
+	uint16_t m_torsionOffset;
+	std::map<std::tuple<bool, std::string, SecStrType>, uint16_t> m_index;
+};
+
+TableTrainer::TableTrainer(float binSpacing)
+	: m_binSpacing(binSpacing)
+{
+	for (auto &aa : cif::compound_factory::kAAMap)
+	{
+		for (auto ss : { SecStrType::helix, SecStrType::strand, SecStrType::other })
+			addTable(false, aa.first, ss);
+	}
+
+	addTable(false, "PRO", SecStrType::cis);
+	for (auto aa : { "***", "GLY", "IV_" })
+		addTable(false, aa, SecStrType::prepro);
+
+	m_torsionOffset = static_cast<uint16_t>(m_tables.size());
+
+	// ALA and GLY have no chi angles and thus no torsion tables
+	for (auto &aa : cif::compound_factory::kAAMap)
+	{
+		if (aa.first == "ALA" or aa.first == "GLY")
+			continue;
+
+		for (auto ss : { SecStrType::helix, SecStrType::strand, SecStrType::other })
+			addTable(true, aa.first, ss);
+	}
+}
+
+void TableTrainer::classify(const cif::mm::polymer &poly, size_t i, const PolymerDihedrals &dihedrals,
+	const SecStrAssignment &secstr, int verbose, std::vector<Observation> &observations) const
+{
+	auto rc = classifyResidue(poly, i, dihedrals, secstr, verbose);
+	if (not rc)
+		return;
+
+	// Scoring replaces unknown compounds with ALA, these should not end up
+	// in the statistics for ALA
+	auto compoundID = poly[i].get_compound_id();
+	if (rc->aa == "ALA" and compoundID != "ALA")
+		return;
+
+	// The prepro tables are shared, see DataTable::loadRamachandranData
+	std::string ramaAA = rc->aa;
+	if (rc->ramachandranSS == SecStrType::prepro)
+	{
+		if (ramaAA == "ILE" or ramaAA == "VAL")
+			ramaAA = "IV_";
+		else if (ramaAA != "GLY")
+			ramaAA = "***";
+	}
+
+	if (auto table = find(false, ramaAA, rc->ramachandranSS))
+		observations.push_back({ *table, dihedrals.phi[i], dihedrals.psi[i] });
+
+	if (dihedrals.chiCount[i] > 0)
+	{
+		if (auto table = find(true, rc->aa, rc->torsionSS))
+			observations.push_back({ *table, dihedrals.chi1[i], dihedrals.chiCount[i] > 1 ? dihedrals.chi2[i] : 0 });
+	}
+}
+
+TableTrainer::Histograms TableTrainer::emptyHistograms() const
+{
+	Histograms result;
+	for (auto &d : m_tables)
+		result.emplace_back(d.counts.size(), 0);
+	return result;
+}
+
+void TableTrainer::finish(Histograms &&histograms, const std::vector<std::vector<Observation>> &observations, size_t nrOfThreads)
+{
+	for (size_t i = 0; i < m_tables.size(); ++i)
+	{
+		m_tables[i].counts = std::move(histograms[i]);
+		m_tables[i].quantize(m_tables[i].twoDimensional());
+	}
+
+	// The observations per table, for the 'vs random' values
+	std::vector<std::vector<std::tuple<float, float>>> angles(m_tables.size());
+	for (auto &structure : observations)
+	{
+		for (auto &o : structure)
+			angles[o.table].emplace_back(o.a1, o.a2);
+	}
+
+	m_observationCounts.clear();
+	for (auto &a : angles)
+		m_observationCounts.push_back(a.size());
+
+	// The mean and sd of the count of the bin of each observation follow
+	// from the counts, see binCountStatistics. The 'vs random' values are
+	// the mean and sd of the z-scores of the observations using the
+	// interpolated counts. As for the distributed tables, the sd values are
+	// sample standard deviations.
+	parallelFor(m_tables.size(), nrOfThreads, [&](size_t i)
+		{
+		auto &d = m_tables[i];
+		auto &a = angles[i];
+
+		if (a.empty())
+			return;
+
+		auto [n, mean, sd] = binCountStatistics(d.counts);
+
+		d.mean = static_cast<float>(mean);
+		d.sd = sd > 0 ? static_cast<float>(sd) : 1;
+
+		double sum = 0, sumSq = 0;
+		for (auto [a1, a2] : a)
+		{
+			double z = d.zscore(a1, a2);
+			sum += z;
+			sumSq += z * z;
+		}
+
+		const double N = static_cast<double>(a.size());
+
+		d.mean_vs_random = static_cast<float>(sum / N);
+		d.sd_vs_random = N > 1 ? static_cast<float>(std::sqrt(std::max((sumSq - sum * sum / N) / (N - 1), 0.0))) : 1; });
+}
+
+void TableTrainer::write(const fs::path &dir, float meanRamachandran, float sdRamachandran, float meanTorsion, float sdTorsion)
+{
+	std::vector<Data> rama, torsion;
+
+	for (size_t i = 0; i < m_tables.size(); ++i)
+	{
+		auto &d = m_tables[i];
+
+		if (m_observationCounts[i] == 0)
+		{
+			d.mean = d.mean_vs_random = 0;
+			d.sd = d.sd_vs_random = 1;
+
+			std::cerr << "Warning: no observations for the " << (i < m_torsionOffset ? "ramachandran" : "torsion")
+					  << " table for " << d.aa << " with secondary structure '" << static_cast<char>(d.ss)
+					  << "', residues using it will score 0" << std::endl;
+		}
+
+		(i < m_torsionOffset ? rama : torsion).push_back(std::move(d));
+	}
+
+	writeDataFile(dir / "rama-data.bin", meanRamachandran, sdRamachandran, rama);
+	writeDataFile(dir / "torsion-data.bin", meanTorsion, sdTorsion, torsion);
+}
+
+// --------------------------------------------------------------------
+
+void trainDataFiles(const fs::path &dir, const fs::path &outputDir, const TrainingOptions &options)
+{
+	const std::regex kStructureRx(R"(.+\.(cif|pdb|ent)(\.gz)?)", std::regex::icase);
+
+	std::vector<fs::path> files;
+	for (auto &entry : fs::recursive_directory_iterator(dir))
+	{
+		if (entry.is_regular_file() and std::regex_match(entry.path().filename().string(), kStructureRx))
+			files.push_back(entry.path());
+	}
+
+	std::sort(files.begin(), files.end());
+
+	if (files.empty())
+		throw std::runtime_error("No structures found in " + dir.string());
+
+	if (options.binSpacing <= 0 or std::abs(360 / options.binSpacing - std::rint(360 / options.binSpacing)) > 1e-3f)
+		throw std::invalid_argument("Invalid bin spacing " + std::to_string(options.binSpacing) + ", it should divide 360");
+
+	TableTrainer trainer(options.binSpacing);
+
+	// First pass, classify the residues of each structure and count the
+	// observations in histograms per thread
+
+	std::vector<std::vector<TableTrainer::Observation>> observations(files.size());
+	std::vector<std::unique_ptr<TableTrainer::Histograms>> histograms;
+	std::map<std::thread::id, TableTrainer::Histograms *> threadHistograms;
+
+	std::mutex m;
+	size_t done = 0, failed = 0;
+
+	parallelFor(files.size(), options.threads, [&](size_t i)
+		{
+		TableTrainer::Histograms *h;
+
+		{
+			std::unique_lock lock(m);
+
+			auto &ht = threadHistograms[std::this_thread::get_id()];
+			if (ht == nullptr)
+			{
+				histograms.emplace_back(new TableTrainer::Histograms(trainer.emptyHistograms()));
+				ht = histograms.back().get();
+			}
+
+			h = ht;
+		}
+
+		try
+		{
+			cif::file f = cif::pdb::read(files[i]);
+			cif::mm::structure structure(f);
+
+			auto secstr = options.secondaryStructure ? options.secondaryStructure(structure) : assignSecStrUsingDSSP(structure);
+
+			for (auto &poly : structure.polymers())
+			{
+				PolymerDihedrals dihedrals(poly);
+
+				for (size_t r = 1; r + 1 < poly.size(); ++r)
+					trainer.classify(poly, r, dihedrals, secstr, options.verbose, observations[i]);
+			}
+
+			for (auto &o : observations[i])
+				trainer.add(*h, o);
+		}
+		catch (const std::exception &ex)
+		{
+			observations[i].clear();
+
+			if (options.verbose > 0)
+				std::cerr << "Skipping " << files[i] << ": " << ex.what() << std::endl;
+
+			std::unique_lock lock(m);
+			++failed;
+		}
+
+		if (options.progress)
+		{
+			std::unique_lock lock(m);
+			options.progress(++done, files.size());
+		} });
+
+	// Merge the histograms of the threads
+
+	auto merged = std::move(*histograms.front());
+	for (size_t i = 1; i < histograms.size(); ++i)
+	{
+		for (size_t t = 0; t < merged.size(); ++t)
+		{
+			auto &dst = merged[t];
+			auto &src = (*histograms[i])[t];
+
+			for (size_t b = 0; b < dst.size(); ++b)
+				dst[b] += src[b];
+		}
+	}
+	histograms.clear();
+
+	trainer.finish(std::move(merged), observations, options.threads);
+
+	// Second pass, the average z-score of each structure using the new
+	// tables, as used for the model z-scores. The mean and sd of those are
+	// the global calibration.
+
+	std::vector<std::optional<float>> ramaPerStructure(files.size()), torsPerStructure(files.size());
+
+	parallelFor(files.size(), options.threads, [&](size_t i)
+		{
+		double ramaSum = 0, torsSum = 0;
+		size_t ramaCount = 0, torsCount = 0;
+
+		for (auto &o : observations[i])
+		{
+			if (trainer.isTorsion(o))
+				torsSum += trainer.zscore(o), ++torsCount;
+			else
+				ramaSum += trainer.zscore(o), ++ramaCount;
+		}
+
+		if (ramaCount > 0)
+			ramaPerStructure[i] = static_cast<float>(ramaSum / ramaCount);
+		if (torsCount > 0)
+			torsPerStructure[i] = static_cast<float>(torsSum / torsCount); });
+
+	auto meanAndSD = [](const std::vector<std::optional<float>> &v)
+	{
+		double sum = 0, sumSq = 0;
+		size_t n = 0;
+
+		for (auto &z : v)
+		{
+			if (not z)
+				continue;
+
+			sum += *z;
+			sumSq += *z * *z;
+			++n;
+		}
+
+		if (n < 2)
+			throw std::runtime_error("Not enough structures to calibrate the z-scores");
+
+		double mean = sum / n;
+		double sd = std::sqrt(std::max(sumSq / n - mean * mean, 0.0));
+
+		// the z-scores are divided by this sd
+		if (not (sd > 1e-6))
+			throw std::runtime_error("The structures all have the same average z-score, cannot calibrate the z-scores");
+
+		return std::make_tuple(static_cast<float>(mean), static_cast<float>(sd));
+	};
+
+	auto [meanRamachandran, sdRamachandran] = meanAndSD(ramaPerStructure);
+	auto [meanTorsion, sdTorsion] = meanAndSD(torsPerStructure);
+
+	if (options.verbose > 0)
+		std::cerr << "Used " << (files.size() - failed) << " of " << files.size() << " structures" << std::endl;
+
+	trainer.write(outputDir, meanRamachandran, sdRamachandran, meanTorsion, sdTorsion);
+
+	// The calibration in the same format as read by buildDataFile
+	std::ofstream out(outputDir / "zscores_proteins.txt");
+	if (not out.is_open())
+		throw std::runtime_error("Could not create zscores_proteins.txt file");
+
+	out << "Rama: average " << meanRamachandran << ", sd " << sdRamachandran << std::endl
+		<< "Rota: average " << meanTorsion << ", sd " << sdTorsion << std::endl;
+}
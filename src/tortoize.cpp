@@ -25,131 +25,31 @@
  */
 
 #include "tortoize.hpp"
+#include "tortoize-json.hpp"
+#include "data-table.hpp"
 #include "revision.hpp"
 
 #include <dssp.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
 namespace fs = std::filesystem;
 
 using json = zeep::json::element;
 
-// --------------------------------------------------------------------
-// simple integer compression, based somewhat on MRS code
-
-class OBitStream
-{
-  public:
-	OBitStream(std::vector<uint8_t> &buffer)
-		: m_buffer(buffer)
-	{
-		m_buffer.push_back(0);
-	}
-
-	OBitStream(const OBitStream &) = delete;
-	OBitStream &operator=(const OBitStream &) = delete;
-
-	void writebit(bool bit)
-	{
-		if (bit)
-			m_buffer.back() |= 1 << m_bitOffset;
-
-		if (--m_bitOffset < 0)
-		{
-			m_buffer.push_back(0);
-			m_bitOffset = 7;
-		}
-	}
-
-	// write fixed size
-	void write(uint32_t value, int bits)
-	{
-		while (bits-- > 0)
-		{
-			if (value & (1UL << bits))
-				m_buffer.back() |= 1 << m_bitOffset;
-
-			if (--m_bitOffset < 0)
-			{
-				m_buffer.push_back(0);
-				m_bitOffset = 7;
-			}
-		}
-	}
-
-	void sync()
-	{
-		writebit(0);
-
-		while (m_bitOffset != 7)
-			writebit(1);
-	}
-
-	const uint8_t *data() const { return m_buffer.data(); }
-	size_t size() const { return m_buffer.size(); }
-
-	friend void WriteArray(OBitStream &bs, const std::vector<uint32_t> &data);
-
-  private:
-	std::vector<uint8_t> &m_buffer;
-	int m_bitOffset = 7;
-};
-
-class IBitStream
-{
-  public:
-	IBitStream(const uint8_t *data)
-		: m_data(data)
-		, m_byte(*m_data++)
-		, m_bitOffset(7)
-	{
-	}
-
-	IBitStream(const OBitStream &bits)
-		: IBitStream(bits.data())
-	{
-	}
-
-	IBitStream(const IBitStream &) = delete;
-	IBitStream &operator=(const IBitStream &) = delete;
-
-	uint32_t read(int bc)
-	{
-		uint32_t result = 0;
-
-		while (bc > 0)
-		{
-			static const uint8_t kM[] = { 0x00, 0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F, 0xFF };
-
-			int bw = m_bitOffset + 1;
-			if (bw > bc)
-				bw = bc;
-
-			m_bitOffset -= bw;
-			result = result << bw | (kM[bw] & (m_byte >> (m_bitOffset + 1)));
-
-			if (m_bitOffset < 0)
-			{
-				m_byte = *m_data++;
-				m_bitOffset = 7;
-			}
-
-			bc -= bw;
-		}
-
-		return result;
-	}
-
-	friend std::vector<uint32_t> ReadArray(IBitStream &bs);
-
-  private:
-	const uint8_t *m_data;
-	uint8_t m_byte;
-	int m_bitOffset;
-};
-
 // --------------------------------------------------------------------
 //    Arrays
 //    This is a simplified version of the array compression routines in MRS
@@ -310,15 +210,6 @@ void DecompressSimpleArraySelector(IBitStream &inBits, std::vector<uint32_t> &ou
 
 // --------------------------------------------------------------------
 
-enum class SecStrType : char
-{
-	helix = 'H',
-	strand = 'E',
-	other = '.',
-	cis = 'c',
-	prepro = 'p'
-};
-
 std::ostream &operator<<(std::ostream &os, SecStrType ss)
 {
 	switch (ss)
@@ -347,101 +238,17 @@ std::string to_string(SecStrType ss)
 	throw std::runtime_error("Invalid sec structure");
 }
 
-// --------------------------------------------------------------------
-// The header for the data blocks as written in de resource
-
-struct StoredData
-{
-	char aa[3];
-	SecStrType ss;
-	float mean, mean_vs_random, sd, sd_vs_random, binSpacing;
-	uint32_t offset; // offset into compressed data area
-};
-
-class Data
+ScoreType parseScoreType(std::string_view s)
 {
-	friend class DataTable;
-
-  public:
-	Data(Data &&d)
-		: aa(d.aa)
-		, ss(d.ss)
-		, mean(d.mean)
-		, sd(d.sd)
-		, mean_vs_random(d.mean_vs_random)
-		, sd_vs_random(d.sd_vs_random)
-		, binSpacing(d.binSpacing)
-		, counts(move(d.counts))
-		, dim(d.dim)
-		, d2(d.d2)
-	{
-	}
-
-	Data(const Data &) = delete;
-	Data &operator=(const Data &) = delete;
-
-	Data(const char *type, const std::string &aa, SecStrType ss, std::istream &is);
-	Data(bool torsion, const StoredData &data, const uint8_t *bits);
-
-	void store(StoredData &data, std::vector<uint8_t> &databits);
-
-	float interpolatedCount(float phi, float a2) const;
-	float zscore(float a1, float a2) const
-	{
-		return (interpolatedCount(a1, a2) - mean) / sd;
-	}
-
-	void dump() const
-	{
-		for (size_t i = 0; i < counts.size(); ++i)
-		{
-			float a1, a2;
-			std::tie(a1, a2) = angles(i);
-			std::cout << a1 << ' ' << a2 << ' ' << counts[i] << std::endl;
-		}
-	}
-
-  private:
-	std::string aa;
-	SecStrType ss;
-	float mean, sd, mean_vs_random, sd_vs_random;
-	float binSpacing;
-	std::vector<uint32_t> counts;
-
-	// calculated
-	size_t dim;
-	bool d2;
-
-	float count(size_t a1Ix, size_t a2Ix) const
-	{
-		a1Ix %= dim;
-		a2Ix %= dim;
-		return static_cast<float>(d2 ? counts.at(a1Ix * dim + a2Ix) : counts.at(a1Ix));
-	}
-
-	size_t index(float a1, float a2 = 0) const
-	{
-		size_t x = 0, y = 0;
-
-		if (d2)
-		{
-			x = static_cast<size_t>((a1 + 180) / binSpacing);
-			y = static_cast<size_t>((a2 + 180) / binSpacing);
-		}
-		else
-			y = static_cast<size_t>((a1 + 180) / binSpacing);
-
-		return x * static_cast<int>(std::rint(360 / binSpacing)) + y;
-	}
-
-	std::tuple<float, float> angles(size_t index) const
-	{
-		size_t x = index / dim;
-		size_t y = index % dim;
-
-		return std::make_tuple(x * binSpacing - 180, y * binSpacing - 180);
-	}
-};
+	if (s == "both")
+		return ScoreType::both;
+	if (s == "ramachandran")
+		return ScoreType::ramachandran;
+	if (s == "torsion")
+		return ScoreType::torsion;
+
+	throw std::invalid_argument("Invalid score type '" + std::string(s) + "', expected ramachandran, torsion or both");
+}
 
 Data::Data(const char *type, const std::string &aa, SecStrType ss, std::istream &is)
 	: aa(aa)
@@ -457,7 +264,7 @@ Data::Data(const char *type, const std::string &aa, SecStrType ss, std::istream
 	std::string line;
 	getline(is, line);
 
-	d2 = strcmp(type, "torsion") != 0 or std::set<std::string>{ "CYS", "SER", "THR", "VAL" }.count(aa) == 0;
+	const bool d2 = isTwoDimensional(strcmp(type, "torsion") == 0, aa);
 
 	std::smatch m;
 	if (not std::regex_match(line, m, kRX1))
@@ -495,8 +302,10 @@ Data::Data(const char *type, const std::string &aa, SecStrType ss, std::istream
 		if (is.eof())
 			throw std::runtime_error("truncated file?");
 
-		counts.at(index(a1, a2)) = count;
+		counts.at(index(d2, a1, a2)) = count;
 	}
+
+	quantize(d2);
 }
 
 Data::Data(bool torsion, const StoredData &data, const uint8_t *databits)
@@ -509,7 +318,7 @@ Data::Data(bool torsion, const StoredData &data, const uint8_t *databits)
 	sd_vs_random = data.sd_vs_random;
 	binSpacing = data.binSpacing;
 
-	d2 = not torsion or std::set<std::string>{ "CYS", "SER", "THR", "VAL" }.count(aa) == 0;
+	const bool d2 = isTwoDimensional(torsion, aa);
 
 	size_t nBins = static_cast<size_t>(360 / binSpacing);
 	dim = nBins;
@@ -521,11 +330,62 @@ Data::Data(bool torsion, const StoredData &data, const uint8_t *databits)
 
 	IBitStream bits(databits + data.offset);
 	DecompressSimpleArraySelector(bits, counts);
+
+	// Only the quantized grid is used for scoring
+	quantize(d2);
+	counts = {};
+}
+
+Data::Data(bool torsion, const std::string &aa, SecStrType ss, float binSpacing)
+	: aa(aa)
+	, ss(ss)
+	, mean(0)
+	, sd(1)
+	, mean_vs_random(0)
+	, sd_vs_random(1)
+	, binSpacing(binSpacing)
+{
+	const bool d2 = isTwoDimensional(torsion, aa);
+	dim = static_cast<size_t>(360 / binSpacing);
+
+	counts.assign(d2 ? dim * dim : dim, 0);
+	quantize(d2);
+}
+
+void Data::quantize(bool twoDimensional)
+{
+	std::vector<float> values(counts.begin(), counts.end());
+
+	if (twoDimensional)
+		grid = Grid<2>(dim, values);
+	else
+		grid = Grid<1>(dim, values);
+}
+
+void Data::resample(float newSpacing)
+{
+	const size_t newDim = static_cast<size_t>(std::rint(360 / newSpacing));
+
+	if (newDim < dim)
+		throw std::invalid_argument("Bin spacing " + std::to_string(newSpacing) + " is coarser than the " +
+									std::to_string(binSpacing) + " degrees of the table for " + aa);
+
+	if (newDim == dim)
+		return;
+
+	std::visit([newDim](auto &g)
+		{ g = g.resample(newDim); },
+		grid);
+
+	binSpacing = 360.0f / newDim;
+	dim = newDim;
+	counts = {};
 }
 
-void Data::store(StoredData &data, std::vector<uint8_t> &databits)
+void Data::store(StoredData &data, std::vector<uint8_t> &databits) const
 {
 	assert(aa.length() == 3);
+	assert(counts.size() == (twoDimensional() ? dim * dim : dim));
 	copy(aa.begin(), aa.end(), data.aa);
 	data.ss = ss;
 	data.mean = mean;
@@ -540,13 +400,80 @@ void Data::store(StoredData &data, std::vector<uint8_t> &databits)
 	bits.sync();
 }
 
-float Data::interpolatedCount(float a1, float a2) const
+// --------------------------------------------------------------------
+
+template <size_t D, typename T>
+Grid<D, T>::Grid(size_t dim, const std::vector<float> &values)
+	: m_dim(dim)
+{
+	assert(values.size() == (D == 2 ? dim * dim : dim));
+
+	if constexpr (std::is_floating_point_v<T>)
+		m_values.assign(values.begin(), values.end());
+	else
+	{
+		float minValue = 0, maxValue = 0;
+		bool integral = true;
+
+		if (not values.empty())
+		{
+			auto [mini, maxi] = std::minmax_element(values.begin(), values.end());
+			minValue = *mini;
+			maxValue = *maxi;
+			integral = std::all_of(values.begin(), values.end(), [](float v)
+				{ return v == std::floor(v); });
+		}
+
+		const float maxStored = static_cast<float>(std::numeric_limits<T>::max());
+
+		if (integral and minValue >= 0 and maxValue <= maxStored)
+		{
+			m_scale = 1;
+			m_offset = 0;
+		}
+		else
+		{
+			m_offset = minValue;
+			m_scale = maxValue > minValue ? (maxValue - minValue) / maxStored : 1;
+		}
+
+		m_values.resize(values.size());
+		for (size_t i = 0; i < values.size(); ++i)
+			m_values[i] = static_cast<T>(std::lrint((values[i] - m_offset) / m_scale));
+	}
+}
+
+template <size_t D, typename T>
+Grid<D, T> Grid<D, T>::resample(size_t dim) const
+{
+	const size_t n2 = D == 2 ? dim : 1;
+
+	std::vector<float> values(dim * n2);
+
+	for (size_t i = 0; i < dim; ++i)
+	{
+		float a1 = (i * 360.0f) / dim - 180;
+
+		for (size_t j = 0; j < n2; ++j)
+		{
+			float a2 = D == 2 ? (j * 360.0f) / dim - 180 : 0;
+
+			auto c = std::get<0>(interpolatedCountAndGradient(a1, a2, Interpolation::bicubic));
+			values[i * n2 + j] = std::max(c, 0.0f);
+		}
+	}
+
+	return Grid(dim, values);
+}
+
+template <size_t D, typename T>
+float Grid<D, T>::interpolatedCount(float a1, float a2) const
 {
-	const size_t N = dim;
+	const size_t N = m_dim;
 
 	float result;
 
-	if (d2)
+	if constexpr (D == 2)
 	{
 		size_t a1FloorIx = static_cast<size_t>(N * (a1 + 180) / 360);
 		size_t a2FloorIx = static_cast<size_t>(N * (a2 + 180) / 360);
@@ -578,12 +505,103 @@ float Data::interpolatedCount(float a1, float a2) const
 
 		float a1Factor = a1CeilIx > a1FloorIx ? (a1 - a1FloorAngle) / (a1CeilAngle - a1FloorAngle) : 1;
 
-		result = count(a1FloorIx, 0) + (count(a1CeilIx, 0) - count(a1FloorIx, 0)) * a1Factor;
+		result = count(a1FloorIx) + (count(a1CeilIx) - count(a1FloorIx)) * a1Factor;
 	}
 
 	return result;
 }
 
+// --------------------------------------------------------------------
+// Catmull-Rom spline through p[0] .. p[3], evaluated at t between p[1] and p[2]
+
+inline float catmullRom(const float p[4], float t)
+{
+	return 0.5f * (2 * p[1] + (p[2] - p[0]) * t + (2 * p[0] - 5 * p[1] + 4 * p[2] - p[3]) * t * t +
+					  (3 * p[1] - p[0] - 3 * p[2] + p[3]) * t * t * t);
+}
+
+inline float catmullRomDerivative(const float p[4], float t)
+{
+	return 0.5f * ((p[2] - p[0]) + 2 * (2 * p[0] - 5 * p[1] + 4 * p[2] - p[3]) * t +
+					  3 * (3 * p[1] - p[0] - 3 * p[2] + p[3]) * t * t);
+}
+
+template <size_t D, typename T>
+std::tuple<float, float, float> Grid<D, T>::interpolatedCountAndGradient(float a1, float a2, Interpolation interpolation) const
+{
+	const size_t N = m_dim;
+	const float cellWidth = 360.0f / N;
+
+	size_t a1FloorIx = static_cast<size_t>(N * (a1 + 180) / 360);
+	float a1Factor = (a1 - ((a1FloorIx * 360.0f) / N - 180)) / cellWidth;
+
+	float value, dA1 = 0, dA2 = 0;
+
+	if constexpr (D == 2)
+	{
+		size_t a2FloorIx = static_cast<size_t>(N * (a2 + 180) / 360);
+		float a2Factor = (a2 - ((a2FloorIx * 360.0f) / N - 180)) / cellWidth;
+
+		if (interpolation == Interpolation::bicubic)
+		{
+			// count() wraps the indices, start one grid point before the cell
+			float q[4], dq[4];
+
+			for (size_t j = 0; j < 4; ++j)
+			{
+				float p[4];
+				for (size_t i = 0; i < 4; ++i)
+					p[i] = count(a1FloorIx + N - 1 + i, a2FloorIx + N - 1 + j);
+
+				q[j] = catmullRom(p, a1Factor);
+				dq[j] = catmullRomDerivative(p, a1Factor);
+			}
+
+			value = catmullRom(q, a2Factor);
+			dA1 = catmullRom(dq, a2Factor) / cellWidth;
+			dA2 = catmullRomDerivative(q, a2Factor) / cellWidth;
+		}
+		else
+		{
+			float c00 = count(a1FloorIx, a2FloorIx), c10 = count(a1FloorIx + 1, a2FloorIx);
+			float c01 = count(a1FloorIx, a2FloorIx + 1), c11 = count(a1FloorIx + 1, a2FloorIx + 1);
+
+			float c1 = c00 + (c10 - c00) * a1Factor;
+			float c2 = c01 + (c11 - c01) * a1Factor;
+
+			value = c1 + (c2 - c1) * a2Factor;
+			dA1 = ((c10 - c00) * (1 - a2Factor) + (c11 - c01) * a2Factor) / cellWidth;
+			dA2 = (c2 - c1) / cellWidth;
+		}
+	}
+	else
+	{
+		if (interpolation == Interpolation::bicubic)
+		{
+			float p[4];
+			for (size_t i = 0; i < 4; ++i)
+				p[i] = count(a1FloorIx + N - 1 + i);
+
+			value = catmullRom(p, a1Factor);
+			dA1 = catmullRomDerivative(p, a1Factor) / cellWidth;
+		}
+		else
+		{
+			float c0 = count(a1FloorIx), c1 = count(a1FloorIx + 1);
+
+			value = c0 + (c1 - c0) * a1Factor;
+			dA1 = (c1 - c0) / cellWidth;
+		}
+	}
+
+	return { value, dA1, dA2 };
+}
+
+template class Grid<1>;
+template class Grid<2>;
+
+// --------------------------------------------------------------------
+
 void buildDataFile(const fs::path &dir)
 {
 	using namespace std::literals;
@@ -614,8 +632,7 @@ void buildDataFile(const fs::path &dir)
 		}
 	}
 
-	std::vector<StoredData> data;
-	std::vector<uint8_t> bits;
+	std::vector<Data> tables;
 
 	// first ramachandran counts
 	for (auto aa : cif::compound_factory::kAAMap)
@@ -630,11 +647,7 @@ void buildDataFile(const fs::path &dir)
 				continue;
 
 			std::ifstream f(p);
-			Data d("rama", aa.first, ss.first, f);
-
-			StoredData sd = {};
-			d.store(sd, bits);
-			data.push_back(sd);
+			tables.emplace_back("rama", aa.first, ss.first, f);
 		}
 	}
 
@@ -649,28 +662,12 @@ void buildDataFile(const fs::path &dir)
 			continue;
 
 		std::ifstream f(p);
-		Data d("rama", std::get<1>(ss), std::get<0>(ss), f);
-
-		StoredData sd = {};
-		d.store(sd, bits);
-		data.push_back(sd);
+		tables.emplace_back("rama", std::get<1>(ss), std::get<0>(ss), f);
 	}
 
-	data.push_back({});
-
-	if (fs::exists("rama-data.bin"))
-		fs::remove("rama-data.bin");
-	std::ofstream out("rama-data.bin", std::ios::binary);
-	if (not out.is_open())
-		throw std::runtime_error("Could not create rama-data.bin file");
-	out.write(reinterpret_cast<char *>(&mean_ramachandran), sizeof(mean_ramachandran));
-	out.write(reinterpret_cast<char *>(&sd_ramachandran), sizeof(sd_ramachandran));
-	out.write(reinterpret_cast<char *>(data.data()), data.size() * sizeof(StoredData));
-	out.write(reinterpret_cast<char *>(bits.data()), bits.size());
-	out.close();
+	writeDataFile("rama-data.bin", mean_ramachandran, sd_ramachandran, tables);
 
-	data.clear();
-	bits.clear();
+	tables.clear();
 
 	// next torsion counts
 	for (auto aa : cif::compound_factory::kAAMap)
@@ -685,23 +682,34 @@ void buildDataFile(const fs::path &dir)
 				continue;
 
 			std::ifstream f(p);
-			Data d("torsion", aa.first, ss.first, f);
-
-			StoredData sd = {};
-			d.store(sd, bits);
-			data.push_back(sd);
+			tables.emplace_back("torsion", aa.first, ss.first, f);
 		}
 	}
 
+	writeDataFile("torsion-data.bin", mean_torsion, sd_torsion, tables);
+}
+
+void writeDataFile(const fs::path &file, float mean, float sd, const std::vector<Data> &tables)
+{
+	std::vector<StoredData> data;
+	std::vector<uint8_t> bits;
+
+	for (auto &d : tables)
+	{
+		StoredData sd = {};
+		d.store(sd, bits);
+		data.push_back(sd);
+	}
+
 	data.push_back({});
 
-	if (fs::exists("torsion-data.bin"))
-		fs::remove("torsion-data.bin");
-	out.open("torsion-data.bin", std::ios::binary);
+	if (fs::exists(file))
+		fs::remove(file);
+	std::ofstream out(file, std::ios::binary);
 	if (not out.is_open())
-		throw std::runtime_error("Could not create torsion-data.bin file");
-	out.write(reinterpret_cast<char *>(&mean_torsion), sizeof(mean_torsion));
-	out.write(reinterpret_cast<char *>(&sd_torsion), sizeof(sd_torsion));
+		throw std::runtime_error("Could not create " + file.string() + " file");
+	out.write(reinterpret_cast<char *>(&mean), sizeof(mean));
+	out.write(reinterpret_cast<char *>(&sd), sizeof(sd));
 	out.write(reinterpret_cast<char *>(data.data()), data.size() * sizeof(StoredData));
 	out.write(reinterpret_cast<char *>(bits.data()), bits.size());
 	out.close();
@@ -709,40 +717,79 @@ void buildDataFile(const fs::path &dir)
 
 // --------------------------------------------------------------------
 
-class DataTable
+std::shared_ptr<const DataTable> loadDataTable(float binSpacing)
+{
+	return std::make_shared<DataTable>(binSpacing);
+}
+
+std::shared_ptr<const DataTable> loadDataTable(const fs::path &dir, float binSpacing)
+{
+	return std::make_shared<DataTable>(dir, binSpacing);
+}
+
+std::shared_ptr<const DataTable> defaultDataTable()
+{
+	static const std::shared_ptr<const DataTable> sInstance = loadDataTable();
+	return sInstance;
+}
+
+DataTable::DataTable(float binSpacing)
 {
-  public:
-	static DataTable &instance()
+	using namespace std::literals;
+
+	for (auto name : { "torsion-data.bin", "rama-data.bin" })
 	{
-		static DataTable sInstance;
-		return sInstance;
-	}
+		auto rfd = cif::load_resource(name);
 
-	const Data &loadTorsionData(const std::string &aa, SecStrType ss) const;
-	const Data &loadRamachandranData(const std::string &aa, SecStrType ss) const;
+		if (not rfd)
+			throw std::runtime_error("Missing resource "s + name);
 
-	float mean_torsion() const { return m_mean_torsion; }
-	float sd_torsion() const { return m_sd_torsion; }
-	float mean_ramachandran() const { return m_mean_ramachandran; }
-	float sd_ramachandran() const { return m_sd_ramachandran; }
+		if (strcmp(name, "torsion-data.bin") == 0)
+			load(name, *rfd, m_torsion, m_mean_torsion, m_sd_torsion);
+		else
+			load(name, *rfd, m_ramachandran, m_mean_ramachandran, m_sd_ramachandran);
+	}
 
-  private:
-	DataTable(const DataTable &) = delete;
-	DataTable &operator=(const DataTable &) = delete;
+	resample(binSpacing);
+}
 
-	DataTable();
+DataTable::DataTable(const fs::path &dir, float binSpacing)
+{
+	for (auto name : { "torsion-data.bin", "rama-data.bin" })
+	{
+		std::ifstream file(dir / name, std::ios::binary);
 
-	void load(const char *name, std::vector<Data> &table, float &mean, float &sd);
+		if (not file.is_open())
+			throw std::runtime_error("Could not open " + (dir / name).string());
 
-	std::vector<Data> m_torsion, m_ramachandran;
+		if (strcmp(name, "torsion-data.bin") == 0)
+			load(name, file, m_torsion, m_mean_torsion, m_sd_torsion);
+		else
+			load(name, file, m_ramachandran, m_mean_ramachandran, m_sd_ramachandran);
+	}
 
-	float m_mean_torsion, m_sd_torsion, m_mean_ramachandran, m_sd_ramachandran;
-};
+	resample(binSpacing);
+}
 
-DataTable::DataTable()
+void DataTable::resample(float binSpacing)
 {
-	load("torsion-data.bin", m_torsion, m_mean_torsion, m_sd_torsion);
-	load("rama-data.bin", m_ramachandran, m_mean_ramachandran, m_sd_ramachandran);
+	if (binSpacing < 0 or (binSpacing > 0 and std::abs(360 / binSpacing - std::rint(360 / binSpacing)) > 1e-3f))
+		throw std::invalid_argument("Invalid bin spacing " + std::to_string(binSpacing) + ", it should divide 360");
+
+	if (binSpacing > 0)
+	{
+		for (auto tbl : { &m_torsion, &m_ramachandran })
+		{
+			for (auto &d : *tbl)
+			{
+				// The one dimensional tables have a finer grid to begin with
+				if (not d.twoDimensional() and binSpacing >= d.binSpacing)
+					continue;
+
+				d.resample(binSpacing);
+			}
+		}
+	}
 }
 
 const Data &DataTable::loadTorsionData(const std::string &aa, SecStrType ss) const
@@ -794,21 +841,16 @@ const Data &DataTable::loadRamachandranData(const std::string &aa, SecStrType ss
 	return *i;
 }
 
-void DataTable::load(const char *name, std::vector<Data> &table, float &mean, float &sd)
+void DataTable::load(const char *name, std::istream &is, std::vector<Data> &table, float &mean, float &sd)
 {
-	using namespace std::literals;
-
-	auto rfd = cif::load_resource(name);
+	is.seekg(0, is.end);
+	auto size = is.tellg();
+	is.seekg(0, is.beg);
 
-	if (not rfd)
-		throw std::runtime_error("Missing resource "s + name);
+	std::unique_ptr<float[]> buffer(new float[size / sizeof(float) + 1]);
+	is.read(reinterpret_cast<char *>(buffer.get()), size);
 
-	rfd->seekg(0, rfd->end);
-	auto size = rfd->tellg();
-	rfd->seekg(0, rfd->beg);
-
-	const float *fv = new float[size / sizeof(float) + 1];
-	rfd->read(reinterpret_cast<char *>(const_cast<float *>(fv)), size);
+	const float *fv = buffer.get();
 
 	mean = fv[0];
 	sd = fv[1];
@@ -827,7 +869,7 @@ void DataTable::load(const char *name, std::vector<Data> &table, float &mean, fl
 
 // --------------------------------------------------------------------
 
-float jackknife(const std::vector<float> &zScorePerResidue)
+float jackknife(const std::vector<float> &zScorePerResidue, float mean, float sd)
 {
 	// jackknife variance estimate, see: https://en.wikipedia.org/wiki/Jackknife_resampling
 
@@ -835,13 +877,11 @@ float jackknife(const std::vector<float> &zScorePerResidue)
 	double zScoreSum = accumulate(zScorePerResidue.begin(), zScorePerResidue.end(), 0.0);
 	std::vector<double> scores(N);
 
-	DataTable &tbl = DataTable::instance();
-
 	double scoreSum = 0;
 	for (size_t i = 0; i < zScorePerResidue.size(); ++i)
 	{
 		double score = (zScoreSum - zScorePerResidue[i]) / (N - 1);
-		score = (score - tbl.mean_ramachandran()) / tbl.sd_ramachandran();
+		score = (score - mean) / sd;
 		scores[i] = score;
 		scoreSum += score;
 	}
@@ -855,174 +895,752 @@ float jackknife(const std::vector<float> &zScorePerResidue)
 
 // --------------------------------------------------------------------
 
-json calculateZScores(const cif::mm::structure &structure)
+std::string to_string(Stage stage)
 {
-	dssp dssp(structure, 3, false);
-	auto &tbl = DataTable::instance();
-
-	double ramaZScoreSum = 0;
-	size_t ramaZScoreCount = 0;
-	double torsZScoreSum = 0;
-	size_t torsZScoreCount = 0;
+	switch (stage)
+	{
+		case Stage::Parse: return "parse";
+		case Stage::Structure: return "structure";
+		case Stage::DSSP: return "dssp";
+		case Stage::Scoring: return "scoring";
+		case Stage::Jackknife: return "jackknife";
+		case Stage::Serialize: return "serialize";
+	}
 
-	json residues;
-	std::vector<float> ramaZScorePerResidue, torsZScorePerResidue;
+	throw std::runtime_error("Invalid stage");
+}
+
+// CPU time used by the current thread
+std::chrono::nanoseconds threadCPUTime()
+{
+#if defined(_WIN32)
+	FILETIME creation, exit, kernel, user;
+	GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+
+	auto ticks = (static_cast<uint64_t>(kernel.dwHighDateTime) << 32 | kernel.dwLowDateTime) +
+	             (static_cast<uint64_t>(user.dwHighDateTime) << 32 | user.dwLowDateTime);
+
+	return std::chrono::nanoseconds(ticks * 100);
+#else
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+#endif
+}
+
+StageTimer::StageTimer(ProfileSink *sink, Stage stage)
+	: m_sink(sink)
+	, m_stage(stage)
+{
+	if (m_sink)
+	{
+		m_sink->begin_stage(stage);
+
+		m_wall_start = std::chrono::steady_clock::now();
+		m_cpu_start = threadCPUTime();
+	}
+}
+
+StageTimer::~StageTimer()
+{
+	stop();
+}
+
+void StageTimer::stop()
+{
+	if (m_sink)
+	{
+		auto wall = std::chrono::steady_clock::now() - m_wall_start;
+		auto cpu = threadCPUTime() - m_cpu_start;
+
+		m_sink->record(m_stage, std::chrono::duration_cast<std::chrono::nanoseconds>(wall), cpu);
+		m_sink = nullptr;
+	}
+}
+
+// --------------------------------------------------------------------
+
+SecStrAssignment assignSecStrUsingDSSP(const cif::mm::structure &structure)
+{
+	auto secstr = std::make_shared<dssp>(structure, 3, false);
+
+	return [secstr](const cif::mm::residue &res) -> std::optional<SecStrType>
+	{
+		try
+		{
+			switch ((*secstr)[{ res.get_asym_id(), res.get_seq_id() }].type())
+			{
+				case dssp::structure_type::Alphahelix: return SecStrType::helix;
+				case dssp::structure_type::Strand: return SecStrType::strand;
+				default: return SecStrType::other;
+			}
+		}
+		catch (const std::out_of_range &e)
+		{
+			return {};
+		}
+	};
+}
+
+// --------------------------------------------------------------------
+
+std::string remapCompoundID(std::string aa, int verbose)
+{
+	// remap some common modified amino acids
+	if (aa == "MSE")
+	{
+		if (verbose > 1)
+			std::cerr << "Replacing MSE with MET" << std::endl;
+		aa = "MET";
+	}
+	else if (aa == "HYP")
+	{
+		if (verbose > 1)
+			std::cerr << "Replacing HYP with PRO" << std::endl;
+
+		aa = "PRO";
+	}
+	else if (aa == "ASX")
+	{
+		if (verbose > 1)
+			std::cerr << "Replacing ASX with ASP" << std::endl;
+
+		aa = "ASP";
+	}
+	else if (aa == "GLX")
+	{
+		if (verbose > 1)
+			std::cerr << "Replacing GLX with GLU" << std::endl;
+
+		aa = "GLU";
+	}
+	else if (not cif::compound_factory::kAAMap.count(aa))
+	{
+		if (verbose > 0)
+			std::cerr << "Replacing " << aa << " with ALA" << std::endl;
+
+		aa = "ALA";
+	}
+
+	return aa;
+}
+
+std::optional<ResidueClass> classifyResidue(const cif::mm::polymer &poly, size_t i, const PolymerDihedrals &dihedrals,
+	const SecStrAssignment &secstr, int verbose)
+{
+	if (i == 0 or i + 1 >= poly.size())
+		return {};
+
+	return classifyResidue(poly, i, dihedrals, secstr(poly[i]), verbose);
+}
+
+std::optional<ResidueClass> classifyResidue(const cif::mm::polymer &poly, size_t i, const PolymerDihedrals &dihedrals,
+	std::optional<SecStrType> ss, int verbose)
+{
+	if (i == 0 or i + 1 >= poly.size())
+		return {};
+
+	if (dihedrals.phi[i] == 360 or dihedrals.psi[i] == 360)
+		return {};
+
+	auto &res = poly[i];
+
+	ResidueClass result;
+	result.aa = remapCompoundID(res.get_compound_id(), verbose);
+
+	if (not ss)
+	{
+		if (verbose > 0)
+			std::cerr << "Residue " << res << " is missing in DSSP" << std::endl;
+		return {};
+	}
+
+	result.torsionSS = *ss;
+
+	if (result.aa != "PRO" and poly[i + 1].get_compound_id() == "PRO")
+		result.ramachandranSS = SecStrType::prepro;
+	else if (result.aa == "PRO" and dihedrals.isCis(i))
+		result.ramachandranSS = SecStrType::cis;
+	else
+		result.ramachandranSS = result.torsionSS;
+
+	return result;
+}
+
+std::optional<ResidueScore> scoreResidue(const cif::mm::polymer &poly, size_t i, const PolymerDihedrals &dihedrals,
+	const SecStrAssignment &secstr, const DataTable &tbl, const TortoizeOptions &options)
+{
+	if (i == 0 or i + 1 >= poly.size())
+		return {};
+
+	auto &res = poly[i];
+
+	if (not isSelected(options.selection, res.get_asym_id(), res.get_seq_id()))
+		return {};
+
+	return scoreResidue(poly, i, dihedrals, secstr(res), tbl, options);
+}
+
+std::optional<ResidueScore> scoreResidue(const cif::mm::polymer &poly, size_t i, const PolymerDihedrals &dihedrals,
+	std::optional<SecStrType> ss, const DataTable &tbl, const TortoizeOptions &options)
+{
+	const int verbose = options.verbose;
+
+	if (i == 0 or i + 1 >= poly.size())
+		return {};
+
+	auto &res = poly[i];
+
+	if (not isSelected(options.selection, res.get_asym_id(), res.get_seq_id()))
+		return {};
+
+	auto rc = classifyResidue(poly, i, dihedrals, ss, verbose);
+	if (not rc)
+		return {};
+
+	ResidueTables tables;
+
+	// throws when the ramachandran statistics are missing
+	if (options.only != ScoreType::torsion)
+		tables.ramachandran = tbl.loadRamachandranData(rc->aa, rc->ramachandranSS).scoringTable<2>();
+
+	// chiCount is 0 when the chi angles were not calculated
+	if (dihedrals.chiCount[i])
+	{
+		try
+		{
+			tables.setTorsion(&tbl.loadTorsionData(rc->aa, rc->torsionSS));
+		}
+		catch (const std::exception &e)
+		{
+			if (verbose > 0)
+				std::cerr << e.what() << '\n';
+		}
+	}
+
+	ResidueScore residue{};
+
+	if (not options.summaryOnly)
+	{
+		residue.asymID = res.get_asym_id();
+		residue.seqID = res.get_seq_id();
+		residue.compoundID = res.get_compound_id();
+		residue.authAsymID = res.get_auth_asym_id();
+		residue.authSeqID = std::stoi(res.get_auth_seq_id());
+		residue.pdbInsCode = res.get_pdb_ins_code();
+	}
+
+	return scoreResidue(std::move(residue), i, dihedrals, *rc, tables, options);
+}
+
+// The torsion z-score of \a residue using the grid type of \a td
+template <size_t D>
+static void scoreTorsion(ResidueScore &residue, const ScoringTable<D> &td, float chi1, float chi2,
+	bool withGradient, Interpolation interpolation)
+{
+	if (withGradient)
+	{
+		auto g = td.zscore(chi1, chi2, interpolation);
+		residue.torsionZ = g.z;
+		residue.torsionGradient = { g.d1, g.d2 };
+	}
+	else
+		residue.torsionZ = td.zscore(chi1, chi2);
+}
+
+std::optional<ResidueScore> scoreResidue(ResidueScore residue, size_t i, const PolymerDihedrals &dihedrals,
+	const ResidueClass &rc, const ResidueTables &tables, const TortoizeOptions &options)
+{
+	auto phi = dihedrals.phi[i];
+	auto psi = dihedrals.psi[i];
+
+	residue.ramachandranSS = rc.ramachandranSS;
+	residue.ramachandranZ = std::numeric_limits<float>::quiet_NaN();
+	residue.phi = phi;
+	residue.psi = psi;
+
+	bool withGradient = options.gradients or options.interpolation != Interpolation::bilinear;
+
+	if (options.only != ScoreType::torsion)
+	{
+		assert(tables.ramachandran);
+		auto &rd = tables.ramachandran;
+
+		if (withGradient)
+		{
+			auto g = rd.zscore(phi, psi, options.interpolation);
+			residue.ramachandranZ = g.z;
+			residue.ramachandranGradient = { g.d1, g.d2 };
+		}
+		else
+			residue.ramachandranZ = rd.zscore(phi, psi);
+	}
+
+	residue.torsionSS = rc.torsionSS;
+
+	auto chiCount = dihedrals.chiCount[i];
+	if (chiCount and (tables.torsion2 or tables.torsion1))
+	{
+		float chi1 = dihedrals.chi1[i];
+		float chi2 = chiCount > 1 ? dihedrals.chi2[i] : 0;
+
+		residue.chi1 = chi1;
+		residue.chi2 = chi2;
+
+		if (tables.torsion2)
+			scoreTorsion(residue, tables.torsion2, chi1, chi2, withGradient, options.interpolation);
+		else
+			scoreTorsion(residue, tables.torsion1, chi1, chi2, withGradient, options.interpolation);
+	}
+
+	if (options.only == ScoreType::torsion and not residue.torsionZ)
+		return {};
+
+	return residue;
+}
+
+ZScoreGradient ramachandranZScore(const std::string &compoundID, SecStrType ss, float phi, float psi, const TortoizeOptions &options)
+{
+	auto &tbl = options.tables ? *options.tables : DataTable::instance();
+	return tbl.loadRamachandranData(compoundID, ss).zscore(phi, psi, options.interpolation);
+}
+
+ZScoreGradient torsionZScore(const std::string &compoundID, SecStrType ss, float chi1, float chi2, const TortoizeOptions &options)
+{
+	auto &tbl = options.tables ? *options.tables : DataTable::instance();
+	return tbl.loadTorsionData(compoundID, ss).zscore(chi1, chi2, options.interpolation);
+}
+
+// --------------------------------------------------------------------
+
+ModelScore calculateScores(const cif::mm::structure &structure, const TortoizeOptions &options)
+{
+	StageTimer dsspTimer(options.profile, Stage::DSSP);
+	auto secstr = options.secondaryStructure ? options.secondaryStructure(structure) : assignSecStrUsingDSSP(structure);
+	dsspTimer.stop();
+
+	auto &tbl = options.tables ? *options.tables : DataTable::instance();
+
+	StageTimer scoringTimer(options.profile, Stage::Scoring);
+
+	ModelScore result;
+	ModelSums sums;
 
 	for (auto &poly : structure.polymers())
 	{
+		PolymerDihedrals dihedrals(poly, dihedralAngles(options.only));
+
 		for (size_t i = 1; i + 1 < poly.size(); ++i)
 		{
-			auto &res = poly[i];
+			auto residue = scoreResidue(poly, i, dihedrals, secstr, tbl, options);
+			if (not residue)
+				continue;
 
-			auto phi = res.phi();
-			auto psi = res.psi();
+			sums.add(poly.get_asym_id(), poly.get_entity_id(), *residue);
 
-			if (phi == 360 or psi == 360)
-				continue;
+			if (not options.summaryOnly)
+				result.residues.push_back(std::move(*residue));
+		}
+	}
 
-			std::string aa = res.get_compound_id();
+	if (not options.windows.empty())
+		calculateLocalZScores(result.residues, options.windows, tbl);
 
-			json residue = {
-				{ "asymID", res.get_asym_id() },
-				{ "seqID", res.get_seq_id() },
-				{ "compID", aa },
-				{ "pdb", { { "strandID", res.get_auth_asym_id() },
-							 { "seqNum", std::stoi(res.get_auth_seq_id()) },
-							 { "compID", aa },
-							 { "insCode", res.get_pdb_ins_code() } } }
-			};
+	scoringTimer.stop();
 
-			// remap some common modified amino acids
-			if (aa == "MSE")
-			{
-				if (cif::VERBOSE > 1)
-					std::cerr << "Replacing MSE with MET" << std::endl;
-				aa = "MET";
-			}
-			else if (aa == "HYP")
-			{
-				if (cif::VERBOSE > 1)
-					std::cerr << "Replacing HYP with PRO" << std::endl;
+	StageTimer jackknifeTimer(options.profile, Stage::Jackknife);
 
-				aa = "PRO";
-			}
-			else if (aa == "ASX")
-			{
-				if (cif::VERBOSE > 1)
-					std::cerr << "Replacing ASX with ASP" << std::endl;
+	sums.store(result, tbl, options.only);
 
-				aa = "ASP";
-			}
-			else if (aa == "GLX")
-			{
-				if (cif::VERBOSE > 1)
-					std::cerr << "Replacing GLX with GLU" << std::endl;
+	jackknifeTimer.stop();
 
-				aa = "GLU";
-			}
-			else if (not cif::compound_factory::instance().kAAMap.count(aa))
-			{
-				if (cif::VERBOSE > 0)
-					std::cerr << "Replacing " << aa << " with ALA" << std::endl;
+	return result;
+}
 
-				aa = "ALA";
-			}
+std::vector<ModelScore> calculateScores(cif::file &file, const TortoizeOptions &options)
+{
+	if (file.empty())
+		throw std::runtime_error("Invalid or empty mmCIF/PDB file");
 
-			SecStrType tors_ss, rama_ss;
+	std::set<uint32_t> modelNrs;
+	for (auto r : file.front()["atom_site"])
+	{
+		if (not r["pdbx_PDB_model_num"].empty())
+			modelNrs.insert(r["pdbx_PDB_model_num"].as<uint32_t>());
+	}
+
+	if (modelNrs.empty())
+		modelNrs.insert(0);
+
+	// With a selection, the structures are created from a copy containing
+	// only the atoms that are needed
+	cif::datablock *db = &file.front();
+
+	std::unique_ptr<cif::datablock> selected;
+	if (not options.selection.empty())
+	{
+		selected.reset(new cif::datablock(selectResidues(file.front(), options.selection, options.verbose)));
+		db = selected.get();
+	}
+
+	std::vector<uint32_t> models(modelNrs.begin(), modelNrs.end());
+	std::vector<ModelScore> result(models.size());
+
+	// The structures share the file, they are therefore constructed one
+	// at a time. The scoring itself runs concurrently.
+	std::mutex m;
+	std::atomic<size_t> next{ 0 };
+	size_t done = 0;
+	std::exception_ptr error;
+
+	auto worker = [&]()
+	{
+		for (;;)
+		{
+			size_t i = next++;
+			if (i >= models.size())
+				break;
 
 			try
 			{
-				switch (dssp[{ res.get_asym_id(), res.get_seq_id() }].type())
+				std::unique_ptr<cif::mm::structure> structure;
+
+				{
+					std::unique_lock lock(m);
+
+					if (error)
+						break;
+
+					if (options.profile)
+						options.profile->begin_model(models[i]);
+
+					StageTimer structureTimer(options.profile, Stage::Structure);
+					structure.reset(new cif::mm::structure(*db, models[i]));
+				}
+
+				result[i] = calculateScores(*structure, options);
+				result[i].modelNr = models[i];
+
+				if (options.progress)
 				{
-					case dssp::structure_type::Alphahelix: tors_ss = SecStrType::helix; break;
-					case dssp::structure_type::Strand: tors_ss = SecStrType::strand; break;
-					default: tors_ss = SecStrType::other; break;
+					std::unique_lock lock(m);
+					options.progress(++done, models.size());
 				}
 			}
-			catch (const std::out_of_range &e)
+			catch (...)
 			{
-				if (cif::VERBOSE > 0)
-					std::cerr << "Residue " << res << " is missing in DSSP" << std::endl;
-				continue;
+				std::unique_lock lock(m);
+				if (not error)
+					error = std::current_exception();
 			}
+		}
+	};
 
-			if (aa != "PRO" and poly[i + 1].get_compound_id() == "PRO")
-				rama_ss = SecStrType::prepro;
-			else if (aa == "PRO" && res.is_cis())
-				rama_ss = SecStrType::cis;
-			else
-				rama_ss = tors_ss;
+	size_t nrOfThreads = std::min(std::max<size_t>(options.threads, 1), models.size());
 
-			// TODO: #pragma warning "todo" (but the question now is, what is here to do???)
-			auto &rd = tbl.loadRamachandranData(aa, rama_ss);
+	if (nrOfThreads == 1)
+		worker();
+	else
+	{
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < nrOfThreads; ++i)
+			threads.emplace_back(worker);
 
-			auto zr = rd.zscore(phi, psi);
+		for (auto &t : threads)
+			t.join();
+	}
 
-			residue["ramachandran"] = {
-				{ "ss-type", to_string(rama_ss) },
-				{ "z-score", zr }
-			};
+	if (error)
+		std::rethrow_exception(error);
 
-			ramaZScorePerResidue.push_back(zr);
+	return result;
+}
 
-			ramaZScoreSum += zr;
-			++ramaZScoreCount;
+// --------------------------------------------------------------------
+// The jackknife estimate as calculated above can be written in terms of
+// the sum and the sum of squares of the z-scores. Leaving out residue i
+// shifts the mean by (mean - z[i]) / (N - 1), the spread of those shifts
+// is therefore the spread of z divided by N - 1.
 
-			try
-			{
-				float zt = nanf("1");
+float jackknife(double sum, double sumSq, size_t n, float sd)
+{
+	double N = static_cast<double>(n);
+	double ss = std::max(sumSq - sum * sum / N, 0.0);
 
-				auto chiCount = res.nr_of_chis();
-				if (chiCount)
-				{
-					float chi1 = res.chi(0);
-					float chi2 = chiCount > 1 ? res.chi(1) : 0;
+	return static_cast<float>(std::sqrt((N - 1) / N * ss) / ((N - 1) * sd));
+}
 
-					auto &td = tbl.loadTorsionData(aa, tors_ss);
+void ModelSums::add(const std::string &asymID, const std::string &entityID, const ResidueScore &score)
+{
+	// NaN when only the torsion scores are calculated
+	if (not std::isnan(score.ramachandranZ))
+	{
+		rama.push_back(score.ramachandranZ);
+		ramaSum += score.ramachandranZ;
+	}
 
-					zt = td.zscore(chi1, chi2);
+	if (score.torsionZ)
+	{
+		torsion.push_back(*score.torsionZ);
+		torsSum += *score.torsionZ;
+	}
 
-					torsZScoreSum += zt;
-					++torsZScoreCount;
+	groups.add(asymID, entityID, score);
+}
 
-					torsZScorePerResidue.push_back(zt);
+void ModelSums::store(ModelScore &result, const DataTable &tbl, ScoreType only) const
+{
+	float ramaVsRand = static_cast<float>(ramaSum / rama.size());
+	float torsVsRand = static_cast<float>(torsSum / torsion.size());
 
-					residue["torsion"] = {
-						{ "ss-type", to_string(tors_ss) },
-						{ "z-score", zt }
-					};
-				}
-			}
-			catch (const std::exception &e)
+	result.ramachandranZ = result.ramachandranJackknifeSD = std::numeric_limits<float>::quiet_NaN();
+	result.torsionZ = result.torsionJackknifeSD = std::numeric_limits<float>::quiet_NaN();
+
+	if (only != ScoreType::torsion)
+	{
+		result.ramachandranZ = (ramaVsRand - tbl.mean_ramachandran()) / tbl.sd_ramachandran();
+		result.ramachandranJackknifeSD = jackknife(rama, tbl.mean_ramachandran(), tbl.sd_ramachandran());
+	}
+
+	if (only != ScoreType::ramachandran)
+	{
+		result.torsionZ = (torsVsRand - tbl.mean_torsion()) / tbl.sd_torsion();
+		// Note, the Ramachandran mean and sd are used here as well
+		result.torsionJackknifeSD = jackknife(torsion, tbl.mean_ramachandran(), tbl.sd_ramachandran());
+	}
+
+	groups.store(result, tbl);
+}
+
+void GroupSums::add(const ResidueScore &score, int sign)
+{
+	// NaN when only the torsion scores are calculated
+	if (not std::isnan(score.ramachandranZ))
+	{
+		double zr = score.ramachandranZ;
+
+		ramaSum += sign * zr;
+		ramaSumSq += sign * zr * zr;
+		ramaCount = sign > 0 ? ramaCount + 1 : ramaCount - 1;
+	}
+
+	if (score.torsionZ)
+	{
+		double zt = *score.torsionZ;
+
+		torsSum += sign * zt;
+		torsSumSq += sign * zt * zt;
+		torsCount = sign > 0 ? torsCount + 1 : torsCount - 1;
+	}
+}
+
+GroupScore GroupSums::score(const DataTable &tbl) const
+{
+	GroupScore result{};
+
+	result.ramachandranCount = ramaCount;
+	result.torsionCount = torsCount;
+
+	float ramaVsRand = static_cast<float>(ramaSum / ramaCount);
+	float torsVsRand = static_cast<float>(torsSum / torsCount);
+
+	result.ramachandranZ = (ramaVsRand - tbl.mean_ramachandran()) / tbl.sd_ramachandran();
+	result.ramachandranJackknifeSD = jackknife(ramaSum, ramaSumSq, ramaCount, tbl.sd_ramachandran());
+	result.torsionZ = (torsVsRand - tbl.mean_torsion()) / tbl.sd_torsion();
+	// Note, the Ramachandran sd is used here as well, as for the model
+	result.torsionJackknifeSD = jackknife(torsSum, torsSumSq, torsCount, tbl.sd_ramachandran());
+
+	return result;
+}
+
+void GroupedSums::store(ModelScore &result, const DataTable &tbl) const
+{
+	// groups can become empty when residues are rescored incrementally
+	for (auto &[asymID, sums] : chains)
+	{
+		if (not sums.empty())
+			result.chains[asymID] = sums.score(tbl);
+	}
+
+	for (auto &[entityID, sums] : entities)
+	{
+		if (not sums.empty())
+			result.entities[entityID] = sums.score(tbl);
+	}
+}
+
+// --------------------------------------------------------------------
+// The local z-scores are calculated per chain using prefix sums, the sum
+// of a window is then the difference of two prefix sums. Since the seq_id
+// increases within a chain, the bounds of the windows only move forward
+// and the total cost is linear in the number of residues.
+
+void calculateLocalZScores(std::vector<ResidueScore> &residues, const std::vector<size_t> &windows, const DataTable &tbl)
+{
+	std::vector<double> ramaSum, torsSum;
+	std::vector<size_t> torsCount;
+
+	for (size_t b = 0, e = 0; b < residues.size(); b = e)
+	{
+		while (e < residues.size() and residues[e].asymID == residues[b].asymID)
+			++e;
+
+		const size_t n = e - b;
+
+		ramaSum.assign(n + 1, 0);
+		torsSum.assign(n + 1, 0);
+		torsCount.assign(n + 1, 0);
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			auto &r = residues[b + i];
+
+			ramaSum[i + 1] = ramaSum[i] + r.ramachandranZ;
+			torsSum[i + 1] = torsSum[i] + r.torsionZ.value_or(0);
+			torsCount[i + 1] = torsCount[i] + (r.torsionZ ? 1 : 0);
+		}
+
+		for (size_t i = 0; i < n; ++i)
+			residues[b + i].local.clear();
+
+		for (size_t window : windows)
+		{
+			const int half = static_cast<int>(window / 2);
+
+			// the window of residue i is [lo, hi)
+			size_t lo = 0, hi = 0;
+
+			for (size_t i = 0; i < n; ++i)
 			{
-				if (cif::VERBOSE > 0)
-					std::cerr << e.what() << '\n';
-			}
+				const int seqID = residues[b + i].seqID;
+
+				while (residues[b + lo].seqID < seqID - half)
+					++lo;
+				while (hi < n and residues[b + hi].seqID <= seqID + half)
+					++hi;
+
+				LocalZScore local{ window };
+
+				float ramaVsRand = static_cast<float>((ramaSum[hi] - ramaSum[lo]) / (hi - lo));
+				local.ramachandranZ = (ramaVsRand - tbl.mean_ramachandran()) / tbl.sd_ramachandran();
+
+				if (size_t count = torsCount[hi] - torsCount[lo]; count > 0)
+				{
+					float torsVsRand = static_cast<float>((torsSum[hi] - torsSum[lo]) / count);
+					local.torsionZ = (torsVsRand - tbl.mean_torsion()) / tbl.sd_torsion();
+				}
 
-			residues.push_back(residue);
+				residues[b + i].local.push_back(local);
+			}
 		}
 	}
+}
+
+// --------------------------------------------------------------------
+
+json to_json(const ResidueScore &score)
+{
+	json result{
+		{ "asymID", score.asymID },
+		{ "seqID", score.seqID },
+		{ "compID", score.compoundID },
+		{ "pdb", { { "strandID", score.authAsymID },
+					 { "seqNum", score.authSeqID },
+					 { "compID", score.compoundID },
+					 { "insCode", score.pdbInsCode } } },
+	};
+
+	if (not std::isnan(score.ramachandranZ))
+	{
+		result["ramachandran"] = {
+			{ "ss-type", to_string(score.ramachandranSS) },
+			{ "z-score", score.ramachandranZ }
+		};
+	}
+
+	if (score.torsionZ)
+	{
+		result["torsion"] = {
+			{ "ss-type", to_string(score.torsionSS) },
+			{ "z-score", *score.torsionZ }
+		};
+	}
+
+	for (auto &local : score.local)
+	{
+		json window{
+			{ "window", local.window }
+		};
+
+		if (not std::isnan(local.ramachandranZ))
+			window["ramachandran-z"] = local.ramachandranZ;
 
-	float ramaVsRand = static_cast<float>(ramaZScoreSum / ramaZScoreCount);
-	float torsVsRand = static_cast<float>(torsZScoreSum / torsZScoreCount);
+		if (local.torsionZ)
+			window["torsion-z"] = *local.torsionZ;
 
-	float jackknifeRama = jackknife(ramaZScorePerResidue);
-	float jackknifeTors = jackknife(torsZScorePerResidue);
+		result["local"].push_back(std::move(window));
+	}
 
-	return {
-		{ "ramachandran-z", ((ramaVsRand - tbl.mean_ramachandran()) / tbl.sd_ramachandran()) },
-		{ "ramachandran-jackknife-sd", jackknifeRama },
-		{ "torsion-z", ((torsVsRand - tbl.mean_torsion()) / tbl.sd_torsion()) },
-		{ "torsion-jackknife-sd", jackknifeTors },
-		{ "residues", residues },
+	return result;
+}
+
+json to_json(const GroupScore &score)
+{
+	json result{
+		{ "ramachandran-count", score.ramachandranCount },
+		{ "torsion-count", score.torsionCount }
 	};
+
+	// The jackknife needs at least two residues and chains without side
+	// chain torsions have no torsion score
+	if (score.ramachandranCount > 0)
+		result["ramachandran-z"] = score.ramachandranZ;
+
+	if (score.ramachandranCount > 1)
+		result["ramachandran-jackknife-sd"] = score.ramachandranJackknifeSD;
+
+	if (score.torsionCount > 0)
+		result["torsion-z"] = score.torsionZ;
+
+	if (score.torsionCount > 1)
+		result["torsion-jackknife-sd"] = score.torsionJackknifeSD;
+
+	return result;
 }
 
-// --------------------------------------------------------------------
+json to_json(const ModelScore &score)
+{
+	json result;
 
-json tortoize_calculate(const fs::path &xyzin)
+	// Scores that were not calculated are left out
+	for (auto [key, value] : { std::make_pair("ramachandran-z", score.ramachandranZ),
+			 std::make_pair("ramachandran-jackknife-sd", score.ramachandranJackknifeSD),
+			 std::make_pair("torsion-z", score.torsionZ),
+			 std::make_pair("torsion-jackknife-sd", score.torsionJackknifeSD) })
+	{
+		if (not std::isnan(value))
+			result[key] = value;
+	}
+
+	for (auto &[asymID, chain] : score.chains)
+		result["chains"][asymID] = to_json(chain);
+
+	for (auto &[entityID, entity] : score.entities)
+		result["entities"][entityID] = to_json(entity);
+
+	if (not score.residues.empty())
+	{
+		auto &residues = result["residues"];
+		for (auto &residue : score.residues)
+			residues.push_back(to_json(residue));
+	}
+
+	return result;
+}
+
+json to_json(const std::vector<ModelScore> &scores)
 {
-	json data{
+	json result{
 		{ "software",
 			{ { "name", "tortoize" },
 				{ "version", kVersionNumber },
@@ -1030,29 +1648,29 @@ json tortoize_calculate(const fs::path &xyzin)
 				{ "reference-doi", "https://doi.org/10.1016/j.str.2020.08.005" } } }
 	};
 
-	// --------------------------------------------------------------------
-
-	cif::file f = cif::pdb::read(xyzin);
+	for (auto &score : scores)
+		result["model"][std::to_string(score.modelNr)] = to_json(score);
 
-	if (f.empty())
-		throw std::runtime_error("Invalid or empty mmCIF/PDB file");
+	return result;
+}
 
-	std::set<uint32_t> models;
-	for (auto r : f.front()["atom_site"])
-	{
-		if (not r["pdbx_PDB_model_num"].empty())
-			models.insert(r["pdbx_PDB_model_num"].as<uint32_t>());
-	}
+// --------------------------------------------------------------------
 
-	if (models.empty())
-		models.insert(0);
+json calculateZScores(const cif::mm::structure &structure, const TortoizeOptions &options)
+{
+	return to_json(calculateScores(structure, options));
+}
 
-	for (auto model : models)
-	{
-		cif::mm::structure structure(f, model);
+json tortoize_calculate(cif::file &file, const TortoizeOptions &options)
+{
+	return to_json(calculateScores(file, options));
+}
 
-		data["model"][std::to_string(model)] = calculateZScores(structure);
-	}
+json tortoize_calculate(const fs::path &xyzin, const TortoizeOptions &options)
+{
+	StageTimer parseTimer(options.profile, Stage::Parse);
+	cif::file f = cif::pdb::read(xyzin);
+	parseTimer.stop();
 
-	return data;
-}
\ No newline at end of file
+	return tortoize_calculate(f, options);
+}
@@ -24,11 +24,474 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#pragma once
+
 #include <cif++.hpp>
-#include <zeep/json/element.hpp>
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
 
 void buildDataFile(const std::filesystem::path &dir);
 
-zeep::json::element calculateZScores(const cif::mm::structure& structure);
+// --------------------------------------------------------------------
+/// The secondary structure types used to select the statistics
+
+enum class SecStrType : char
+{
+	helix = 'H',
+	strand = 'E',
+	other = '.',
+	cis = 'c',
+	prepro = 'p'
+};
+
+std::ostream &operator<<(std::ostream &os, SecStrType ss);
+std::string to_string(SecStrType ss);
+
+/// Assigns the secondary structure for the residues of a single model.
+/// Should return helix, strand or other. A residue for which no value is
+/// returned is not scored.
+using SecStrAssignment = std::function<std::optional<SecStrType>(const cif::mm::residue &)>;
+
+/// Creates the assignment for a model, called once for each model
+using SecStrProvider = std::function<SecStrAssignment(const cif::mm::structure &)>;
+
+/// The default provider, uses DSSP
+SecStrAssignment assignSecStrUsingDSSP(const cif::mm::structure &structure);
+
+// --------------------------------------------------------------------
+// Optional instrumentation of the calculation. A ProfileSink receives
+// the wall clock and CPU time spent in each stage.
+
+enum class Stage
+{
+	Parse,     ///< Reading the coordinates file
+	Structure, ///< Constructing the cif::mm::structure for a model
+	DSSP,      ///< Secondary structure assignment
+	Scoring,   ///< Calculating the dihedral angles and the residue z-scores
+	Jackknife, ///< The jackknife standard deviations
+	Serialize  ///< Writing the results
+};
+
+std::string to_string(Stage stage);
+
+class ProfileSink
+{
+  public:
+	virtual ~ProfileSink() = default;
+
+	/// Called before the stages of model \a nr are reported
+	virtual void begin_model(uint32_t nr) {}
+
+	/// Called when \a stage starts
+	virtual void begin_stage(Stage stage) {}
+
+	virtual void record(Stage stage, std::chrono::nanoseconds wall, std::chrono::nanoseconds cpu) = 0;
+};
+
+/// Reports the time between construction and stop() or destruction as
+/// \a stage to \a sink. Does nothing at all when \a sink is null.
+
+class StageTimer
+{
+  public:
+	StageTimer(ProfileSink *sink, Stage stage);
+	~StageTimer();
+
+	StageTimer(const StageTimer &) = delete;
+	StageTimer &operator=(const StageTimer &) = delete;
+
+	void stop();
+
+  private:
+	ProfileSink *m_sink;
+	Stage m_stage;
+	std::chrono::steady_clock::time_point m_wall_start;
+	std::chrono::nanoseconds m_cpu_start;
+};
+
+// --------------------------------------------------------------------
+/// The statistics used for scoring. A loaded table is immutable and can be
+/// shared by any number of threads without locking.
+///
+/// The grids are kept as 16 bit values with a scale and offset per table.
+/// When \a binSpacing is not zero, the grids are resampled to \a binSpacing
+/// degrees when loading, using the bicubic interpolation of the stored
+/// grid. Scoring the finer grid with the bilinear interpolation then comes
+/// close to the bicubic one at the cost of the bilinear lookup. This adds
+/// no statistical resolution and trades cache for smoothness, a 1 degree
+/// grid is nine times the size of a 3 degree one. Finer statistics need
+/// tables trained with a finer spacing, see trainDataFiles.
+///
+/// The spacing should divide 360 and may not be coarser than that of the
+/// two dimensional grids, otherwise std::invalid_argument is thrown. The
+/// one dimensional torsion tables already have a finer grid, they are only
+/// resampled when \a binSpacing is finer still.
+
+class DataTable;
+
+std::shared_ptr<const DataTable> loadDataTable(float binSpacing = 0);
+
+/// Load the tables from rama-data.bin and torsion-data.bin in \a dir
+/// instead of the resources, e.g. the tables written by trainDataFiles
+std::shared_ptr<const DataTable> loadDataTable(const std::filesystem::path &dir, float binSpacing = 0);
+
+/// The shared default tables, loaded on first use
+std::shared_ptr<const DataTable> defaultDataTable();
+
+// --------------------------------------------------------------------
+/// The interpolation used between the grid points of the statistics.
+/// Bicubic uses a Catmull-Rom spline through the surrounding 4x4 grid
+/// points, it is smoother and has continuous derivatives.
+
+enum class Interpolation
+{
+	bilinear,
+	bicubic
+};
+
+/// A z-score and its derivatives to the first and second angle, in 1/degree
+
+struct ZScoreGradient
+{
+	float z, d1, d2;
+};
+
+// --------------------------------------------------------------------
+/// The scores to calculate. The values of scores that are not calculated
+/// are NaN, or not set for optional values.
+
+enum class ScoreType
+{
+	both,
+	ramachandran,
+	torsion
+};
+
+/// Parse "both", "ramachandran" or "torsion", throws std::invalid_argument
+/// for anything else
+ScoreType parseScoreType(std::string_view s);
+
+// --------------------------------------------------------------------
+/// A range of residues in a chain, using the label_asym_id and
+/// label_seq_id. Without bounds the range covers the whole chain.
+
+struct ResidueRange
+{
+	std::string asymID;
+	std::optional<int> first, last;
+
+	bool contains(const std::string &asymID, int seqID) const
+	{
+		return asymID == this->asymID and
+		       (not first or seqID >= *first) and
+		       (not last or seqID <= *last);
+	}
+};
+
+/// The residues to score, all residues when empty
+using Selection = std::vector<ResidueRange>;
+
+/// Parse a selection expression, a comma separated list of chains or
+/// residue ranges, e.g. "A,B:10-50,C:7". Throws std::invalid_argument
+/// for a malformed expression.
+Selection parseSelection(std::string_view expression);
+
+bool isSelected(const Selection &selection, const std::string &asymID, int seqID);
+
+// --------------------------------------------------------------------
+/// Options for the calculation of the z-scores
+
+struct TortoizeOptions
+{
+	/// Only report the model level scores, leave out the per residue scores
+	bool summaryOnly = false;
+
+	/// The number of models scored concurrently
+	size_t threads = 1;
+
+	/// The secondary structure assignment, DSSP if not specified
+	SecStrProvider secondaryStructure;
+
+	/// The statistics to use, a shared default instance if not specified
+	std::shared_ptr<const DataTable> tables;
+
+	/// Diagnostic output to std::cerr, used instead of cif::VERBOSE
+	int verbose = 0;
+
+	/// The interpolation used for the z-scores
+	Interpolation interpolation = Interpolation::bilinear;
+
+	/// Calculate the derivatives of the residue z-scores to the angles
+	bool gradients = false;
+
+	/// The sizes of the windows, in residues, for the local z-scores. The
+	/// window of a residue contains the scored residues in the same chain
+	/// whose seq_id differs at most window / 2. No local z-scores are
+	/// calculated when empty or when summaryOnly is set.
+	std::vector<size_t> windows;
+
+	/// Only calculate the Ramachandran or the torsion scores. The angles,
+	/// table lookups and sums needed only for the other are skipped. With
+	/// torsion only, residues without chi angles are not reported.
+	ScoreType only = ScoreType::both;
+
+	/// Only score these residues. When scoring a cif::file, the atoms of
+	/// residues that are not needed are removed before the structure is
+	/// created. The secondary structure is then assigned for the selection
+	/// and the residues close enough to form hydrogen bonds with it.
+	Selection selection;
+
+	/// If specified, called after each model with the number of models
+	/// done and the total number of models. Calls are serialized.
+	std::function<void(size_t, size_t)> progress;
+
+	/// If not null, the timing of each stage is reported here. Note that
+	/// with more than one thread the stages of models are interleaved and
+	/// the sink is called from multiple threads.
+	ProfileSink *profile = nullptr;
+};
+
+// --------------------------------------------------------------------
+/// The z-scores over the residues in a window around a residue, normalised
+/// in the same way as the model z-scores.
+
+struct LocalZScore
+{
+	size_t window;
+	float ramachandranZ;
+	std::optional<float> torsionZ; ///< Not set when no residue in the window has chi angles
+};
+
+/// The scores for a single residue
+
+struct ResidueScore
+{
+	std::string asymID;
+	int seqID;
+	std::string compoundID;
+
+	std::string authAsymID;
+	int authSeqID;
+	std::string pdbInsCode;
+
+	SecStrType ramachandranSS;
+	float ramachandranZ;
+
+	SecStrType torsionSS;
+	std::optional<float> torsionZ; ///< Not set for residues without chi angles
+
+	float phi, psi, chi1, chi2;
+
+	/// The derivatives d(z)/d(phi), d(z)/d(psi) and d(z)/d(chi1),
+	/// d(z)/d(chi2), in 1/degree. Only set when options.gradients is true.
+	std::array<float, 2> ramachandranGradient, torsionGradient;
+
+	/// The local z-scores, one for each of options.windows
+	std::vector<LocalZScore> local;
+};
+
+/// The scores for a group of residues, a chain or an entity
+
+struct GroupScore
+{
+	float ramachandranZ, ramachandranJackknifeSD;
+	float torsionZ, torsionJackknifeSD;
+
+	/// The number of residues contributing to the scores
+	size_t ramachandranCount, torsionCount;
+};
+
+/// The scores for a model
+
+struct ModelScore
+{
+	uint32_t modelNr = 0;
+
+	float ramachandranZ, ramachandranJackknifeSD;
+	float torsionZ, torsionJackknifeSD;
+
+	/// The scores per chain, by asym ID, and per entity, by entity ID
+	std::map<std::string, GroupScore> chains, entities;
+
+	/// Empty if options.summaryOnly was set
+	std::vector<ResidueScore> residues;
+};
+
+/// Calculate the scores for a single model.
+///
+/// Concurrent calls are safe as long as each call uses its own structure,
+/// the statistics are only read and no global state is modified. The
+/// options, including a ProfileSink, may be shared if the sink itself is
+/// thread safe.
+ModelScore calculateScores(const cif::mm::structure &structure, const TortoizeOptions &options = {});
+
+/// Calculate the scores for all models in \a file
+std::vector<ModelScore> calculateScores(cif::file &file, const TortoizeOptions &options = {});
+
+// --------------------------------------------------------------------
+/// Score a single pair of angles, e.g. for use as a restraint. Here the
+/// compound ID must be one of the twenty standard amino acids and \a ss
+/// the secondary structure type of the table to use, including cis and
+/// prepro for Ramachandran. Throws when no such table exists.
+
+ZScoreGradient ramachandranZScore(const std::string &compoundID, SecStrType ss, float phi, float psi,
+	const TortoizeOptions &options = {});
+
+ZScoreGradient torsionZScore(const std::string &compoundID, SecStrType ss, float chi1, float chi2,
+	const TortoizeOptions &options = {});
+
+// --------------------------------------------------------------------
+/// Scores a model that is modified repeatedly, e.g. during refinement.
+/// After the initial scoring only residues reported as changed are
+/// rescored, together with their direct neighbours since phi, psi and the
+/// cis state depend on those. The model scores are kept as running sums,
+/// updating them takes time proportional to the number of changed residues.
+///
+/// The secondary structure is assigned once, at construction. DSSP needs
+/// the complete hydrogen bond network, call updateSecondaryStructure to
+/// redo the assignment after larger changes.
+///
+/// The structure must outlive the scorer and its residues should not be
+/// added or removed, only moved.
+
+struct PolymerTopology;
+struct PolymerDihedrals;
+struct GroupedSums;
+
+class IncrementalScorer
+{
+  public:
+	IncrementalScorer(const cif::mm::structure &structure, const TortoizeOptions &options = {});
+	~IncrementalScorer();
+
+	IncrementalScorer(const IncrementalScorer &) = delete;
+	IncrementalScorer &operator=(const IncrementalScorer &) = delete;
+
+	/// Rescore after the residues with these asym ID and seq ID have changed
+	void update(const std::vector<std::tuple<std::string, int>> &residues);
+
+	/// Rescore after these atoms have moved
+	void update(const std::vector<cif::mm::atom> &atoms);
+
+	/// Redo the secondary structure assignment and rescore the residues
+	/// whose assignment changed
+	void updateSecondaryStructure();
+
+	/// The current scores. Unless options.summaryOnly is set this copies
+	/// the scores of all residues, and calculates the local z-scores, so
+	/// it takes time proportional to the size of the model.
+	ModelScore score() const;
+
+	/// The current model, chain and entity scores without the per residue
+	/// scores. This only reads the running sums, its cost does not depend
+	/// on the size of the model.
+	ModelScore summary() const;
+
+  private:
+	struct Entry
+	{
+		const cif::mm::polymer *poly;
+		size_t polyIndex;
+		size_t index;
+		std::optional<SecStrType> ss;
+		std::optional<ResidueScore> score;
+	};
+
+	void rescore(Entry &entry);
+	void add(const Entry &entry, int sign);
+
+	const cif::mm::structure &m_structure;
+	TortoizeOptions m_options;
+	std::shared_ptr<const DataTable> m_tables;
+	SecStrAssignment m_secstr;
+
+	std::vector<PolymerTopology> m_topology;
+	std::vector<PolymerDihedrals> m_dihedrals;
+	std::vector<Entry> m_residues;
+	std::map<std::tuple<std::string, int>, size_t> m_index;
+
+	// running sums of the z-scores and their squares, for the model and
+	// per chain and entity
+	double m_ramaSum = 0, m_ramaSumSq = 0, m_torsSum = 0, m_torsSumSq = 0;
+	size_t m_ramaCount = 0, m_torsCount = 0;
+	std::unique_ptr<GroupedSums> m_groups;
+};
+
+// --------------------------------------------------------------------
+/// Scores candidate models that share their topology, i.e. the same
+/// polymers with the same residues and atoms in the same order, and that
+/// only differ in coordinates. The classification of the residues, the
+/// selection of the tables and the atom indices are determined once, for
+/// the structure passed to the constructor.
+///
+/// The score methods can be called concurrently.
+
+class CandidateScorer
+{
+  public:
+	CandidateScorer(const cif::mm::structure &topology, const TortoizeOptions &options = {});
+	~CandidateScorer();
+
+	CandidateScorer(const CandidateScorer &) = delete;
+	CandidateScorer &operator=(const CandidateScorer &) = delete;
+
+	/// Score \a candidate, the secondary structure is assigned for the
+	/// candidate itself
+	ModelScore score(const cif::mm::structure &candidate) const;
+
+	/// Score a set of coordinates, in the order of the atoms of the topology
+	/// structure. The secondary structure of the topology is used.
+	ModelScore score(const std::vector<cif::point> &coordinates) const;
+
+  private:
+	struct Residue;
+	struct Polymer;
+
+	ModelScore score(const std::vector<cif::point> &coordinates, const std::vector<std::optional<SecStrType>> &secstr) const;
+
+	std::vector<std::optional<SecStrType>> assignSecStr(const cif::mm::structure &structure) const;
+
+	TortoizeOptions m_options;
+	std::shared_ptr<const DataTable> m_tables;
+	size_t m_atomCount;
+	std::vector<Polymer> m_polymers;
+	std::vector<std::optional<SecStrType>> m_secstr;
+};
+
+// --------------------------------------------------------------------
+/// Options for deriving new statistics from a set of structures
+
+struct TrainingOptions
+{
+	/// The number of structures processed concurrently
+	size_t threads = 1;
+
+	/// The secondary structure assignment, DSSP if not specified
+	SecStrProvider secondaryStructure;
+
+	/// The bin spacing in degrees of the two dimensional tables, the one
+	/// dimensional torsion tables use the smaller of this and 0.5 degrees.
+	/// Finer grids need more structures to be reliable.
+	float binSpacing = 3;
+
+	/// Diagnostic output to std::cerr
+	int verbose = 0;
+
+	/// If specified, called after each structure with the number of
+	/// structures done and the total number. Calls are serialized.
+	std::function<void(size_t, size_t)> progress;
+};
 
-zeep::json::element tortoize_calculate(const std::filesystem::path &xyzin);
+/// Derive new statistics from the structures in \a dir and its
+/// subdirectories and write rama-data.bin, torsion-data.bin and
+/// zscores_proteins.txt to \a outputDir. The residues are classified as
+/// in calculateScores, the tables have the layout of the distributed
+/// tables. Structures that cannot be read are skipped.
+void trainDataFiles(const std::filesystem::path &dir, const std::filesystem::path &outputDir, const TrainingOptions &options = {});
@@ -0,0 +1,438 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ * 
+ * Copyright (c) 2020 NKI/AVL, Netherlands Cancer Institute
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Micro benchmarks for the scoring kernels and the end-to-end calculation.
+// The results are written in JSON so they can be compared between releases.
+
+#include "tortoize.hpp"
+#include "tortoize-json.hpp"
+#include "data-table.hpp"
+#include "revision.hpp"
+
+#include <mcfp/mcfp.hpp>
+#include <zeep/json/parser.hpp>
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <regex>
+
+#ifndef _MSC_VER
+#include <sys/resource.h>
+#endif
+
+namespace fs = std::filesystem;
+
+using json = zeep::json::element;
+
+// --------------------------------------------------------------------
+// A minimal benchmark harness. Each benchmark runs its operation n times,
+// the harness doubles n until a run takes at least the minimum time and
+// then reports the fastest and the median of a number of such runs.
+
+struct Benchmark
+{
+	std::string name;
+	std::function<void(size_t)> run;
+};
+
+// keeps the optimiser from removing the work
+volatile float gSink;
+
+json runBenchmark(const Benchmark &benchmark, double minTime, size_t repetitions)
+{
+	using clock = std::chrono::steady_clock;
+
+	auto timeRun = [&benchmark](size_t n)
+	{
+		auto start = clock::now();
+		benchmark.run(n);
+		return std::chrono::duration<double>(clock::now() - start).count();
+	};
+
+	size_t n = 1;
+	while (timeRun(n) < minTime)
+		n *= 2;
+
+	std::vector<double> nsPerOp;
+	for (size_t i = 0; i < repetitions; ++i)
+		nsPerOp.push_back(timeRun(n) * 1e9 / n);
+
+	std::sort(nsPerOp.begin(), nsPerOp.end());
+
+	return {
+		{ "name", benchmark.name },
+		{ "iterations", n },
+		{ "repetitions", repetitions },
+		{ "ns-per-op", nsPerOp.front() },
+		{ "ns-per-op-median", nsPerOp[nsPerOp.size() / 2] },
+		{ "ops-per-second", 1e9 / nsPerOp.front() }
+	};
+}
+
+size_t peakMemoryUsage()
+{
+	size_t result = 0;
+
+#ifndef _MSC_VER
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+	{
+#if defined(__APPLE__)
+		result = usage.ru_maxrss;
+#else
+		result = usage.ru_maxrss * 1024;
+#endif
+	}
+#endif
+
+	return result;
+}
+
+// --------------------------------------------------------------------
+
+std::vector<Benchmark> createBenchmarks(const fs::path &testDir)
+{
+	std::vector<Benchmark> result;
+
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> angle(-180, 180);
+
+	// A fixed set of random angles, shared by the table lookups
+	auto angles = std::make_shared<std::vector<float>>(2048);
+	for (auto &a : *angles)
+		a = angle(rng);
+
+	auto &tbl = DataTable::instance();
+
+	result.push_back({ "interpolated-count-2d", [angles, rd = tbl.loadRamachandranData("ALA", SecStrType::helix).scoringTable<2>()](size_t n)
+		{
+			auto &a = *angles;
+			float sum = 0;
+			for (size_t i = 0; i < n; ++i)
+				sum += rd.grid->interpolatedCount(a[(2 * i) % a.size()], a[(2 * i + 1) % a.size()]);
+			gSink = sum; } });
+
+	result.push_back({ "interpolated-count-1d", [angles, td = tbl.loadTorsionData("VAL", SecStrType::other).scoringTable<1>()](size_t n)
+		{
+			auto &a = *angles;
+			float sum = 0;
+			for (size_t i = 0; i < n; ++i)
+				sum += td.grid->interpolatedCount(a[i % a.size()], 0);
+			gSink = sum; } });
+
+	// A compressed array the size of a 3 degree 2D table
+	auto bits = std::make_shared<std::vector<uint8_t>>();
+	{
+		std::geometric_distribution<uint32_t> counts(0.01);
+		std::vector<uint32_t> data(120 * 120);
+		for (auto &c : data)
+			c = counts(rng);
+
+		OBitStream obits(*bits);
+		CompressSimpleArraySelector(obits, data);
+		obits.sync();
+	}
+
+	result.push_back({ "decompress-simple-array", [bits](size_t n)
+		{
+			std::vector<uint32_t> data(120 * 120);
+			for (size_t i = 0; i < n; ++i)
+			{
+				IBitStream ibits(bits->data());
+				DecompressSimpleArraySelector(ibits, data);
+			}
+			gSink = static_cast<float>(data.back()); } });
+
+	result.push_back({ "data-table-construction", [](size_t n)
+		{
+			for (size_t i = 0; i < n; ++i)
+			{
+				DataTable tbl;
+				gSink = tbl.mean_ramachandran();
+			} } });
+
+	float mean = tbl.mean_ramachandran(), sd = tbl.sd_ramachandran();
+
+	for (size_t size : { 1000, 100000 })
+	{
+		auto zscores = std::make_shared<std::vector<float>>(size);
+		std::normal_distribution<float> z;
+		for (auto &v : *zscores)
+			v = z(rng);
+
+		result.push_back({ "jackknife-" + std::to_string(size), [zscores, mean, sd](size_t n)
+			{
+				for (size_t i = 0; i < n; ++i)
+					gSink = jackknife(*zscores, mean, sd); } });
+	}
+
+	// End-to-end, with and without reading the file
+
+	auto xyzin = testDir / "1cbs.cif.gz";
+
+	auto file = std::make_shared<cif::file>(cif::pdb::read(xyzin));
+	auto structure = std::make_shared<cif::mm::structure>(*file, 1);
+
+	// The dihedral angles, per residue and batched per polymer
+	result.push_back({ "residue-dihedrals-1cbs", [structure](size_t n)
+		{
+			float sum = 0;
+			for (size_t i = 0; i < n; ++i)
+			{
+				for (auto &poly : structure->polymers())
+				{
+					for (auto &res : poly)
+					{
+						sum += res.phi() + res.psi();
+						if (res.nr_of_chis() > 0)
+							sum += res.chi(0);
+						if (res.nr_of_chis() > 1)
+							sum += res.chi(1);
+					}
+				}
+			}
+			gSink = sum; } });
+
+	result.push_back({ "polymer-dihedrals-1cbs", [structure](size_t n)
+		{
+			float sum = 0;
+			for (size_t i = 0; i < n; ++i)
+			{
+				for (auto &poly : structure->polymers())
+				{
+					PolymerDihedrals dihedrals(poly);
+					sum += dihedrals.phi.front();
+				}
+			}
+			gSink = sum; } });
+
+	// With the atom indices resolved beforehand
+	auto topology = std::make_shared<std::vector<PolymerTopology>>();
+	for (auto &poly : structure->polymers())
+		topology->emplace_back(poly);
+
+	result.push_back({ "polymer-dihedrals-cached-1cbs", [structure, topology](size_t n)
+		{
+			float sum = 0;
+			for (size_t i = 0; i < n; ++i)
+			{
+				size_t ix = 0;
+				for (auto &poly : structure->polymers())
+				{
+					PolymerDihedrals dihedrals(poly, (*topology)[ix++]);
+					sum += dihedrals.phi.front();
+				}
+			}
+			gSink = sum; } });
+
+	result.push_back({ "calculate-zscores-1cbs", [file, structure](size_t n)
+		{
+			for (size_t i = 0; i < n; ++i)
+			{
+				auto r = calculateZScores(*structure);
+				gSink = r["ramachandran-z"].as<float>();
+			} } });
+
+	result.push_back({ "tortoize-calculate-1cbs", [xyzin](size_t n)
+		{
+			for (size_t i = 0; i < n; ++i)
+			{
+				auto r = tortoize_calculate(xyzin);
+				gSink = r["model"]["1"]["ramachandran-z"].as<float>();
+			} } });
+
+	return result;
+}
+
+// --------------------------------------------------------------------
+// Compare results to a baseline recorded earlier on the same machine.
+// A benchmark regresses when it is more than tolerance slower, timings are
+// noisy so the default tolerance is generous.
+
+bool compareToBaseline(const json &results, const json &baseline, double tolerance, double memoryTolerance)
+{
+	bool result = true;
+
+	std::map<std::string, double> baselineNsPerOp;
+	for (auto &b : baseline["benchmarks"])
+		baselineNsPerOp[b["name"].as<std::string>()] = b["ns-per-op"].as<double>();
+
+	for (auto &r : results["benchmarks"])
+	{
+		auto name = r["name"].as<std::string>();
+
+		auto i = baselineNsPerOp.find(name);
+		if (i == baselineNsPerOp.end())
+		{
+			std::cerr << name << ": not in baseline" << std::endl;
+			continue;
+		}
+
+		double ratio = r["ns-per-op"].as<double>() / i->second;
+
+		std::cerr << name << ": " << std::fixed << std::setprecision(2) << ratio << "x baseline";
+		if (ratio > 1 + tolerance)
+		{
+			std::cerr << " REGRESSION";
+			result = false;
+		}
+		std::cerr << std::endl;
+	}
+
+	auto peak = results["peak-rss-bytes"].as<double>();
+	auto baselinePeak = baseline["peak-rss-bytes"].as<double>();
+
+	if (baselinePeak > 0)
+	{
+		double ratio = peak / baselinePeak;
+
+		std::cerr << "peak-rss: " << std::fixed << std::setprecision(2) << ratio << "x baseline";
+		if (ratio > 1 + memoryTolerance)
+		{
+			std::cerr << " REGRESSION";
+			result = false;
+		}
+		std::cerr << std::endl;
+	}
+
+	return result;
+}
+
+// --------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+	auto &config = mcfp::config::instance();
+
+	config.init("tortoize-bench [options] [test-dir]",
+		mcfp::make_option("help,h", "Display help message"),
+		mcfp::make_option("list", "List the benchmarks"),
+		mcfp::make_option<std::string>("filter", "Only run benchmarks whose name matches this regular expression"),
+		mcfp::make_option<double>("min-time", 0.25, "Minimal time in seconds for a single run of a benchmark"),
+		mcfp::make_option<size_t>("repetitions", 5, "Number of runs per benchmark"),
+		mcfp::make_option<std::string>("output,o", "Write the results to this file instead of stdout"),
+		mcfp::make_option<std::string>("baseline", "Compare the results to this baseline, exits with 1 on a regression and 77 if the baseline does not exist"),
+		mcfp::make_option("update-baseline", "Write the results to the baseline file instead of comparing"),
+		mcfp::make_option<double>("tolerance", 0.3, "Allowed relative increase of time per operation"),
+		mcfp::make_option<double>("memory-tolerance", 0.2, "Allowed relative increase of peak memory"));
+
+	config.parse(argc, argv);
+
+	if (config.has("help"))
+	{
+		std::cout << config << std::endl;
+		exit(0);
+	}
+
+	int result = 0;
+
+	try
+	{
+		fs::path testDir = config.operands().empty() ? fs::current_path() : fs::path(config.operands().front());
+		cif::add_data_directory(testDir / ".." / "rsrc");
+
+		auto benchmarks = createBenchmarks(testDir);
+
+		if (config.has("list"))
+		{
+			for (auto &b : benchmarks)
+				std::cout << b.name << std::endl;
+			exit(0);
+		}
+
+		std::regex filter(config.has("filter") ? config.get<std::string>("filter") : ".*");
+
+		json results{
+			{ "software",
+				{ { "name", "tortoize-bench" },
+					{ "version", kVersionNumber } } }
+		};
+
+		for (auto &b : benchmarks)
+		{
+			if (not std::regex_search(b.name, filter))
+				continue;
+
+			std::cerr << b.name << "... ";
+			auto r = runBenchmark(b, config.get<double>("min-time"), config.get<size_t>("repetitions"));
+			std::cerr << r["ns-per-op"].as<double>() << " ns/op" << std::endl;
+
+			results["benchmarks"].push_back(r);
+		}
+
+		results["peak-rss-bytes"] = peakMemoryUsage();
+
+		if (config.has("baseline"))
+		{
+			fs::path baselineFile = config.get<std::string>("baseline");
+
+			if (config.has("update-baseline"))
+			{
+				if (baselineFile.has_parent_path())
+					fs::create_directories(baselineFile.parent_path());
+
+				std::ofstream of(baselineFile);
+				if (not of.is_open())
+					throw std::runtime_error("Could not open baseline file " + baselineFile.string());
+				of << results;
+			}
+			else
+			{
+				std::ifstream in(baselineFile);
+				if (not in.is_open())
+				{
+					std::cerr << "No baseline " << baselineFile << ", create one with --update-baseline" << std::endl;
+					exit(77);
+				}
+
+				json baseline;
+				zeep::json::parse_json(in, baseline);
+
+				if (not compareToBaseline(results, baseline, config.get<double>("tolerance"), config.get<double>("memory-tolerance")))
+					result = 1;
+			}
+		}
+
+		if (config.has("output"))
+		{
+			std::ofstream of(config.get<std::string>("output"));
+			if (not of.is_open())
+				throw std::runtime_error("Could not open output file");
+			of << results;
+		}
+		else
+			std::cout << results << std::endl;
+	}
+	catch (const std::exception &ex)
+	{
+		std::cerr << ex.what() << std::endl;
+		exit(1);
+	}
+
+	return result;
+}
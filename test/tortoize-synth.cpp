@@ -0,0 +1,604 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ * 
+ * Copyright (c) 2020 NKI/AVL, Netherlands Cancer Institute
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Generator for synthetic protein structures, to be used in scaling
+// benchmarks. The backbone is built from phi/psi angles typical for the
+// requested secondary structure, side chains are built up to the atoms
+// needed for the chi angles. The geometry is plausible, it is not meant
+// to pass any other validation.
+
+#include <mcfp/mcfp.hpp>
+#include <cif++.hpp>
+
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <random>
+
+namespace fs = std::filesystem;
+
+// --------------------------------------------------------------------
+
+const double kPI = 3.141592653589793238462643383279502884;
+
+struct Vec
+{
+	double x, y, z;
+};
+
+Vec operator+(Vec a, Vec b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+Vec operator-(Vec a, Vec b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+Vec operator*(Vec a, double f) { return { a.x * f, a.y * f, a.z * f }; }
+
+Vec cross(Vec a, Vec b)
+{
+	return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+}
+
+Vec normalize(Vec a)
+{
+	double l = std::sqrt(a.x * a.x + a.y * a.y + a.z * a.z);
+	return a * (1 / l);
+}
+
+// Place atom d such that |cd| == length, angle bcd == angle and the
+// dihedral abcd == torsion (Natural Extension Reference Frame)
+Vec place(Vec a, Vec b, Vec c, double length, double angle, double torsion)
+{
+	angle *= kPI / 180;
+	torsion *= kPI / 180;
+
+	Vec bc = normalize(c - b);
+	Vec n = normalize(cross(b - a, bc));
+	Vec m = cross(n, bc);
+
+	Vec d2{ -length * std::cos(angle), length * std::sin(angle) * std::cos(torsion), length * std::sin(angle) * std::sin(torsion) };
+
+	return c + bc * d2.x + m * d2.y + n * d2.z;
+}
+
+// --------------------------------------------------------------------
+// Side chain topology, the atoms defining the chi angles and the atoms
+// branching off from those.
+
+struct SideChain
+{
+	std::vector<std::string> chiAtoms;
+
+	struct Branch
+	{
+		std::string atom;
+		size_t chi;
+		double offset;
+	};
+
+	std::vector<Branch> branches;
+};
+
+const std::map<std::string, SideChain> kSideChains{
+	{ "ALA", {} },
+	{ "ARG", { { "CG", "CD", "NE", "CZ" } } },
+	{ "ASN", { { "CG", "OD1" }, { { "ND2", 1, 180 } } } },
+	{ "ASP", { { "CG", "OD1" }, { { "OD2", 1, 180 } } } },
+	{ "CYS", { { "SG" } } },
+	{ "GLN", { { "CG", "CD", "OE1" }, { { "NE2", 2, 180 } } } },
+	{ "GLU", { { "CG", "CD", "OE1" }, { { "OE2", 2, 180 } } } },
+	{ "GLY", {} },
+	{ "HIS", { { "CG", "ND1" }, { { "CD2", 1, 180 } } } },
+	{ "ILE", { { "CG1", "CD1" }, { { "CG2", 0, -120 } } } },
+	{ "LEU", { { "CG", "CD1" }, { { "CD2", 1, 120 } } } },
+	{ "LYS", { { "CG", "CD", "CE", "NZ" } } },
+	{ "MET", { { "CG", "SD", "CE" } } },
+	{ "PHE", { { "CG", "CD1" }, { { "CD2", 1, 180 } } } },
+	{ "PRO", { { "CG", "CD" } } },
+	{ "SER", { { "OG" } } },
+	{ "THR", { { "OG1" }, { { "CG2", 0, -120 } } } },
+	{ "TRP", { { "CG", "CD1" }, { { "CD2", 1, 180 } } } },
+	{ "TYR", { { "CG", "CD1" }, { { "CD2", 1, 180 } } } },
+	{ "VAL", { { "CG1" }, { { "CG2", 0, 120 } } } }
+};
+
+// --------------------------------------------------------------------
+
+enum class Backbone
+{
+	helix,
+	strand,
+	coil,
+	mixed
+};
+
+struct Residue
+{
+	std::string compoundID;
+	char ss;
+	double phi, psi, omega;
+	std::vector<double> chi;
+};
+
+struct Atom
+{
+	std::string name;
+	Vec location;
+};
+
+class Generator
+{
+  public:
+	Generator(uint32_t seed, std::vector<std::pair<std::string, double>> composition, Backbone backbone)
+		: m_rng(seed)
+		, m_composition(std::move(composition))
+		, m_backbone(backbone)
+	{
+	}
+
+	std::vector<Residue> createChain(size_t length);
+
+	// Create a variant of chain, as for an extra model in an ensemble
+	std::vector<Residue> perturb(std::vector<Residue> chain);
+
+	std::vector<std::vector<Atom>> build(const std::vector<Residue> &chain, Vec origin);
+
+  private:
+	double normal(double mean, double sd)
+	{
+		return std::normal_distribution<double>(mean, sd)(m_rng);
+	}
+
+	void backboneAngles(Residue &r, char ss);
+	void chiAngles(Residue &r);
+
+	std::mt19937 m_rng;
+	std::vector<std::pair<std::string, double>> m_composition;
+	Backbone m_backbone;
+};
+
+std::vector<Residue> Generator::createChain(size_t length)
+{
+	std::vector<double> weights;
+	for (auto &c : m_composition)
+		weights.push_back(c.second);
+	std::discrete_distribution<size_t> compound(weights.begin(), weights.end());
+
+	std::vector<Residue> result(length);
+
+	char ss = 'H';
+	size_t segmentLeft = 0;
+
+	for (auto &r : result)
+	{
+		r.compoundID = m_composition[compound(m_rng)].first;
+
+		switch (m_backbone)
+		{
+			case Backbone::helix: ss = 'H'; break;
+			case Backbone::strand: ss = 'E'; break;
+			case Backbone::coil: ss = '.'; break;
+			case Backbone::mixed:
+				if (segmentLeft == 0)
+				{
+					ss = "HE."[std::uniform_int_distribution<int>(0, 2)(m_rng)];
+					segmentLeft = std::uniform_int_distribution<size_t>(4, 16)(m_rng);
+				}
+				--segmentLeft;
+				break;
+		}
+
+		r.ss = ss;
+
+		backboneAngles(r, ss);
+		chiAngles(r);
+	}
+
+	return result;
+}
+
+void Generator::backboneAngles(Residue &r, char ss)
+{
+	// regions of the Ramachandran plot used for coil residues
+	static const double kCoil[][2] = {
+		{ -65, -40 }, { -120, 130 }, { -75, 145 }, { 60, 40 }
+	};
+
+	switch (ss)
+	{
+		case 'H':
+			r.phi = normal(-63, 5);
+			r.psi = normal(-42, 5);
+			break;
+
+		case 'E':
+			r.phi = normal(-120, 10);
+			r.psi = normal(130, 10);
+			break;
+
+		default:
+		{
+			auto i = std::discrete_distribution<int>({ 3, 3, 3, r.compoundID == "GLY" ? 3 : 0.3 })(m_rng);
+			r.phi = normal(kCoil[i][0], 12);
+			r.psi = normal(kCoil[i][1], 12);
+			break;
+		}
+	}
+
+	if (r.compoundID == "PRO")
+		r.phi = normal(-65, 5);
+
+	r.omega = normal(180, 4);
+}
+
+void Generator::chiAngles(Residue &r)
+{
+	auto &sc = kSideChains.at(r.compoundID);
+
+	r.chi.clear();
+	for (size_t i = 0; i < sc.chiAtoms.size(); ++i)
+	{
+		double chi;
+
+		if (r.compoundID == "PRO")
+			chi = i == 0 ? normal(30, 5) : normal(-35, 5);
+		else if (i == 1 and (r.compoundID == "PHE" or r.compoundID == "TYR" or r.compoundID == "HIS" or r.compoundID == "TRP"))
+			chi = normal(90, 15);
+		else
+		{
+			// the three staggered rotamers
+			static const double kRotamers[] = { -60, 180, 60 };
+			chi = normal(kRotamers[std::discrete_distribution<int>({ 55, 30, 15 })(m_rng)], 10);
+		}
+
+		r.chi.push_back(chi);
+	}
+}
+
+std::vector<Residue> Generator::perturb(std::vector<Residue> chain)
+{
+	for (auto &r : chain)
+	{
+		r.phi += normal(0, 4);
+		r.psi += normal(0, 4);
+		for (auto &chi : r.chi)
+			chi += normal(0, 8);
+	}
+
+	return chain;
+}
+
+std::vector<std::vector<Atom>> Generator::build(const std::vector<Residue> &chain, Vec origin)
+{
+	std::vector<std::vector<Atom>> result;
+
+	// the first residue is placed along the x axis
+	Vec n = origin;
+	Vec ca = origin + Vec{ 1.458, 0, 0 };
+	Vec c = place(Vec{ 0, 1, 0 } + origin, n, ca, 1.525, 111.2, 0);
+
+	for (size_t i = 0; i < chain.size(); ++i)
+	{
+		auto &r = chain[i];
+
+		if (i > 0)
+		{
+			auto &prev = chain[i - 1];
+			Vec prevN = result.back()[0].location, prevCA = result.back()[1].location, prevC = result.back()[2].location;
+
+			n = place(prevN, prevCA, prevC, 1.329, 116.2, prev.psi);
+			ca = place(prevCA, prevC, n, 1.458, 121.7, prev.omega);
+			c = place(prevC, n, ca, 1.525, 111.2, r.phi);
+		}
+
+		std::vector<Atom> atoms{ { "N", n }, { "CA", ca }, { "C", c } };
+
+		// The carbonyl oxygen is trans to the next nitrogen
+		Vec nextN = place(n, ca, c, 1.329, 116.2, r.psi);
+		atoms.push_back({ "O", place(nextN, ca, c, 1.231, 120.5, 180) });
+
+		if (r.compoundID != "GLY")
+		{
+			Vec cb = place(n, c, ca, 1.530, 109.5, 122.6);
+			atoms.push_back({ "CB", cb });
+
+			auto &sc = kSideChains.at(r.compoundID);
+
+			// a, b and c are the three atoms before the one being placed
+			std::vector<Vec> path{ n, ca, cb };
+			for (size_t j = 0; j < sc.chiAtoms.size(); ++j)
+			{
+				auto &pa = path[j], &pb = path[j + 1], &pc = path[j + 2];
+
+				path.push_back(place(pa, pb, pc, 1.52, 113, r.chi[j]));
+				atoms.push_back({ sc.chiAtoms[j], path.back() });
+
+				for (auto &branch : sc.branches)
+				{
+					if (branch.chi == j)
+						atoms.push_back({ branch.atom, place(pa, pb, pc, 1.52, 113, r.chi[j] + branch.offset) });
+				}
+			}
+		}
+
+		result.push_back(std::move(atoms));
+	}
+
+	return result;
+}
+
+// --------------------------------------------------------------------
+
+std::string chainID(size_t nr)
+{
+	std::string result;
+
+	for (;;)
+	{
+		result.insert(result.begin(), static_cast<char>('A' + nr % 26));
+		if (nr < 26)
+			break;
+		nr = nr / 26 - 1;
+	}
+
+	return result;
+}
+
+void writeStructure(std::ostream &os, const std::vector<std::vector<Residue>> &chains,
+	const std::vector<std::vector<std::vector<std::vector<Atom>>>> &models)
+{
+	os << "data_SYNTH" << std::endl
+	   << "#" << std::endl
+	   << "_entry.id SYNTH" << std::endl
+	   << "#" << std::endl;
+
+	// Each chain is an entity of its own, the sequences are random
+	os << "loop_" << std::endl
+	   << "_entity.id" << std::endl
+	   << "_entity.type" << std::endl
+	   << "_entity.pdbx_description" << std::endl;
+	for (size_t i = 0; i < chains.size(); ++i)
+		os << i + 1 << " polymer 'synthetic chain " << chainID(i) << "'" << std::endl;
+	os << "#" << std::endl;
+
+	std::set<std::string> compounds;
+	for (auto &chain : chains)
+	{
+		for (auto &r : chain)
+			compounds.insert(r.compoundID);
+	}
+
+	os << "loop_" << std::endl
+	   << "_chem_comp.id" << std::endl
+	   << "_chem_comp.type" << std::endl
+	   << "_chem_comp.mon_nstd_flag" << std::endl;
+	for (auto &c : compounds)
+		os << c << " 'L-peptide linking' y" << std::endl;
+	os << "#" << std::endl;
+
+	os << "loop_" << std::endl
+	   << "_entity_poly.entity_id" << std::endl
+	   << "_entity_poly.type" << std::endl
+	   << "_entity_poly.nstd_linkage" << std::endl
+	   << "_entity_poly.nstd_monomer" << std::endl
+	   << "_entity_poly.pdbx_strand_id" << std::endl;
+	for (size_t i = 0; i < chains.size(); ++i)
+		os << i + 1 << " polypeptide(L) no no " << chainID(i) << std::endl;
+	os << "#" << std::endl;
+
+	os << "loop_" << std::endl
+	   << "_entity_poly_seq.entity_id" << std::endl
+	   << "_entity_poly_seq.num" << std::endl
+	   << "_entity_poly_seq.mon_id" << std::endl
+	   << "_entity_poly_seq.hetero" << std::endl;
+	for (size_t i = 0; i < chains.size(); ++i)
+	{
+		for (size_t j = 0; j < chains[i].size(); ++j)
+			os << i + 1 << ' ' << j + 1 << ' ' << chains[i][j].compoundID << " n" << std::endl;
+	}
+	os << "#" << std::endl;
+
+	os << "loop_" << std::endl
+	   << "_struct_asym.id" << std::endl
+	   << "_struct_asym.pdbx_blank_PDB_chainid_flag" << std::endl
+	   << "_struct_asym.pdbx_modified" << std::endl
+	   << "_struct_asym.entity_id" << std::endl
+	   << "_struct_asym.details" << std::endl;
+	for (size_t i = 0; i < chains.size(); ++i)
+		os << chainID(i) << " N N " << i + 1 << " ?" << std::endl;
+	os << "#" << std::endl;
+
+	os << "loop_" << std::endl
+	   << "_pdbx_poly_seq_scheme.asym_id" << std::endl
+	   << "_pdbx_poly_seq_scheme.entity_id" << std::endl
+	   << "_pdbx_poly_seq_scheme.seq_id" << std::endl
+	   << "_pdbx_poly_seq_scheme.mon_id" << std::endl
+	   << "_pdbx_poly_seq_scheme.ndb_seq_num" << std::endl
+	   << "_pdbx_poly_seq_scheme.pdb_seq_num" << std::endl
+	   << "_pdbx_poly_seq_scheme.auth_seq_num" << std::endl
+	   << "_pdbx_poly_seq_scheme.pdb_mon_id" << std::endl
+	   << "_pdbx_poly_seq_scheme.auth_mon_id" << std::endl
+	   << "_pdbx_poly_seq_scheme.pdb_strand_id" << std::endl
+	   << "_pdbx_poly_seq_scheme.pdb_ins_code" << std::endl
+	   << "_pdbx_poly_seq_scheme.hetero" << std::endl;
+	for (size_t i = 0; i < chains.size(); ++i)
+	{
+		auto asymID = chainID(i);
+		for (size_t j = 0; j < chains[i].size(); ++j)
+		{
+			auto &compoundID = chains[i][j].compoundID;
+			os << asymID << ' ' << i + 1 << ' ' << j + 1 << ' ' << compoundID << ' '
+			   << j + 1 << ' ' << j + 1 << ' ' << j + 1 << ' ' << compoundID << ' ' << compoundID << ' '
+			   << asymID << " . n" << std::endl;
+		}
+	}
+	os << "#" << std::endl;
+
+	os << "loop_" << std::endl;
+	for (auto item : { "group_PDB", "id", "type_symbol", "label_atom_id", "label_alt_id", "label_comp_id",
+			 "label_asym_id", "label_entity_id", "label_seq_id", "pdbx_PDB_ins_code", "Cartn_x", "Cartn_y", "Cartn_z",
+			 "occupancy", "B_iso_or_equiv", "pdbx_formal_charge", "auth_seq_id", "auth_comp_id", "auth_asym_id",
+			 "auth_atom_id", "pdbx_PDB_model_num" })
+		os << "_atom_site." << item << std::endl;
+
+	size_t atomID = 1;
+	os << std::fixed;
+
+	for (size_t m = 0; m < models.size(); ++m)
+	{
+		for (size_t i = 0; i < chains.size(); ++i)
+		{
+			auto asymID = chainID(i);
+
+			for (size_t j = 0; j < chains[i].size(); ++j)
+			{
+				auto &compoundID = chains[i][j].compoundID;
+
+				for (auto &atom : models[m][i][j])
+				{
+					os << "ATOM " << atomID++ << ' ' << atom.name.front() << ' ' << atom.name << " . "
+					   << compoundID << ' ' << asymID << ' ' << i + 1 << ' ' << j + 1 << " ? "
+					   << std::setprecision(3) << atom.location.x << ' ' << atom.location.y << ' ' << atom.location.z << ' '
+					   << "1.00 20.00 0 " << j + 1 << ' ' << compoundID << ' ' << asymID << ' ' << atom.name << ' '
+					   << m + 1 << std::endl;
+				}
+			}
+		}
+	}
+
+	os << "#" << std::endl;
+}
+
+// --------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+	auto &config = mcfp::config::instance();
+
+	config.init("tortoize-synth [options] [output]",
+		mcfp::make_option("help,h", "Display help message"),
+		mcfp::make_option<size_t>("chains", 1, "Number of chains"),
+		mcfp::make_option<size_t>("residues", 100, "Number of residues per chain"),
+		mcfp::make_option<size_t>("models", 1, "Number of models"),
+		mcfp::make_option<std::string>("backbone", "mixed", "Backbone conformation, one of helix, strand, coil or mixed"),
+		mcfp::make_option<std::string>("composition", "",
+			"Comma separated list of residue types to use, optionally with a weight, e.g. ALA=2,GLY,LEU=3. The default is all twenty"),
+		mcfp::make_option<uint32_t>("seed", 1, "Seed for the random number generator"));
+
+	config.parse(argc, argv);
+
+	if (config.has("help"))
+	{
+		std::cout << config << std::endl
+				  << std::endl
+				  << "Writes a synthetic structure in mmCIF format to output, or stdout" << std::endl;
+		exit(0);
+	}
+
+	try
+	{
+		std::vector<std::pair<std::string, double>> composition;
+
+		auto spec = config.get<std::string>("composition");
+		if (spec.empty())
+		{
+			for (auto &sc : kSideChains)
+				composition.emplace_back(sc.first, 1);
+		}
+		else
+		{
+			for (auto &item : cif::split<std::string>(spec, ",", true))
+			{
+				double weight = 1;
+				std::string compoundID = item;
+
+				if (auto eq = item.find('='); eq != std::string::npos)
+				{
+					compoundID = item.substr(0, eq);
+					weight = std::stod(item.substr(eq + 1));
+				}
+
+				cif::to_upper(compoundID);
+				if (kSideChains.count(compoundID) == 0)
+					throw std::runtime_error("Unsupported residue type " + compoundID);
+
+				composition.emplace_back(compoundID, weight);
+			}
+		}
+
+		Backbone backbone;
+		auto bb = config.get<std::string>("backbone");
+		if (bb == "helix")
+			backbone = Backbone::helix;
+		else if (bb == "strand")
+			backbone = Backbone::strand;
+		else if (bb == "coil")
+			backbone = Backbone::coil;
+		else if (bb == "mixed")
+			backbone = Backbone::mixed;
+		else
+			throw std::runtime_error("Invalid backbone type " + bb);
+
+		Generator generator(config.get<uint32_t>("seed"), composition, backbone);
+
+		size_t nrOfChains = config.get<size_t>("chains");
+		size_t nrOfResidues = config.get<size_t>("residues");
+		size_t nrOfModels = std::max<size_t>(config.get<size_t>("models"), 1);
+
+		std::vector<std::vector<Residue>> chains;
+		for (size_t i = 0; i < nrOfChains; ++i)
+			chains.push_back(generator.createChain(nrOfResidues));
+
+		// chains start on a grid, 40 Å apart
+		size_t gridSize = static_cast<size_t>(std::ceil(std::sqrt(nrOfChains)));
+
+		std::vector<std::vector<std::vector<std::vector<Atom>>>> models(nrOfModels);
+		for (size_t m = 0; m < nrOfModels; ++m)
+		{
+			for (size_t i = 0; i < nrOfChains; ++i)
+			{
+				Vec origin{ 40.0 * (i % gridSize), 40.0 * (i / gridSize), 0 };
+				models[m].push_back(generator.build(m == 0 ? chains[i] : generator.perturb(chains[i]), origin));
+			}
+		}
+
+		if (config.operands().empty())
+			writeStructure(std::cout, chains, models);
+		else
+		{
+			fs::path output = config.operands().front();
+
+			cif::gzio::ofstream of(output);
+			if (not of.is_open())
+				throw std::runtime_error("Could not open output file " + output.string());
+
+			writeStructure(of, chains, models);
+		}
+	}
+	catch (const std::exception &ex)
+	{
+		std::cerr << ex.what() << std::endl;
+		exit(1);
+	}
+
+	return 0;
+}
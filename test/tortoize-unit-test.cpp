@@ -31,9 +31,13 @@ namespace tt = boost::test_tools;
 namespace utf = boost::unit_test;
 
 #include <filesystem>
+#include <random>
 #include <zeep/json/parser.hpp>
 
 #include "tortoize.hpp"
+#include "tortoize-json.hpp"
+#include "data-table.hpp"
+#include "dihedrals.hpp"
 
 namespace fs = std::filesystem;
 
@@ -64,6 +68,45 @@ bool init_unit_test()
 	return true;
 }
 
+// --------------------------------------------------------------------
+// Most tests use 1cbs and its default scores. These are loaded once, on
+// first use, and shared by the tests using this fixture. The tests should
+// not modify them.
+
+struct Fixture1cbs
+{
+	struct Shared
+	{
+		Shared(const fs::path &path)
+			: file(cif::pdb::read(path))
+			, structure(file)
+			, full(calculateScores(structure))
+		{
+		}
+
+		cif::file file;
+		cif::mm::structure structure;
+		ModelScore full;
+	};
+
+	static Shared &shared()
+	{
+		static Shared sShared(gTestDir / "1cbs.cif.gz");
+		return sShared;
+	}
+
+	Fixture1cbs()
+		: file(shared().file)
+		, structure(shared().structure)
+		, full(shared().full)
+	{
+	}
+
+	cif::file &file;
+	const cif::mm::structure &structure;
+	const ModelScore &full;
+};
+
 // --------------------------------------------------------------------
 
 BOOST_AUTO_TEST_CASE(first_test, *utf::tolerance(0.0001))
@@ -83,4 +126,436 @@ BOOST_AUTO_TEST_CASE(first_test, *utf::tolerance(0.0001))
 
 	BOOST_TEST(ma["torsion-jackknife-sd"].as<double>() == mb["torsion-jackknife-sd"].as<double>());
 	BOOST_TEST(ma["torsion-z"].as<double>() == mb["torsion-z"].as<double>());
-}
\ No newline at end of file
+}
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(typed_results, *utf::tolerance(0.0001))
+{
+	cif::file file = cif::pdb::read(gTestDir / "1cbs.cif.gz");
+
+	auto scores = calculateScores(file);
+	BOOST_TEST_REQUIRE(scores.size() == 1);
+
+	auto &model = scores.front();
+	BOOST_TEST(model.modelNr == 1);
+	BOOST_TEST(not model.residues.empty());
+
+	auto j = to_json(scores)["model"]["1"];
+
+	BOOST_TEST(model.ramachandranZ == j["ramachandran-z"].as<double>());
+	BOOST_TEST(model.torsionZ == j["torsion-z"].as<double>());
+
+	TortoizeOptions options;
+	options.summaryOnly = true;
+
+	auto summary = calculateScores(file, options);
+	BOOST_TEST(summary.front().residues.empty());
+	BOOST_TEST(summary.front().ramachandranJackknifeSD == model.ramachandranJackknifeSD);
+}
+
+// --------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(incremental, Fixture1cbs, *utf::tolerance(0.0001))
+{
+	IncrementalScorer scorer(structure);
+	auto a = scorer.score();
+
+	BOOST_TEST(a.ramachandranZ == full.ramachandranZ);
+	BOOST_TEST(a.ramachandranJackknifeSD == full.ramachandranJackknifeSD);
+	BOOST_TEST(a.torsionZ == full.torsionZ);
+	BOOST_TEST(a.torsionJackknifeSD == full.torsionJackknifeSD);
+	BOOST_TEST(a.residues.size() == full.residues.size());
+
+	auto summary = scorer.summary();
+	BOOST_TEST(summary.residues.empty());
+	BOOST_TEST(summary.ramachandranZ == full.ramachandranZ);
+	BOOST_TEST(summary.torsionZ == full.torsionZ);
+
+	// Rescoring unchanged residues should not change the totals
+	std::vector<std::tuple<std::string, int>> changed;
+	for (auto &r : full.residues)
+		changed.emplace_back(r.asymID, r.seqID);
+	scorer.update(changed);
+
+	auto b = scorer.score();
+
+	BOOST_TEST(b.ramachandranZ == full.ramachandranZ);
+	BOOST_TEST(b.torsionJackknifeSD == full.torsionJackknifeSD);
+
+	// The chain sums are running totals as well
+	BOOST_TEST_REQUIRE(b.chains.size() == full.chains.size());
+	for (auto &[asymID, chain] : full.chains)
+	{
+		BOOST_TEST(b.chains[asymID].ramachandranZ == chain.ramachandranZ);
+		BOOST_TEST(b.chains[asymID].ramachandranCount == chain.ramachandranCount);
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(gradients, *utf::tolerance(0.0001))
+{
+	TortoizeOptions options;
+
+	// The bilinear z-score is the one used for the normal scoring
+	options.interpolation = Interpolation::bilinear;
+	BOOST_TEST(ramachandranZScore("ALA", SecStrType::helix, -63.5f, -41.2f, options).z ==
+			   ramachandranZScore("ALA", SecStrType::helix, -63.5f, -41.2f, TortoizeOptions{}).z);
+
+	// Compare the analytic derivatives of the smooth surface to finite differences
+	options.interpolation = Interpolation::bicubic;
+
+	const float h = 0.05f;
+
+	for (auto [phi, psi] : std::vector<std::pair<float, float>>{ { -63.5f, -41.2f }, { -121.3f, 128.7f }, { 57.1f, 44.9f } })
+	{
+		auto g = ramachandranZScore("ALA", SecStrType::other, phi, psi, options);
+
+		float d1 = (ramachandranZScore("ALA", SecStrType::other, phi + h, psi, options).z -
+					   ramachandranZScore("ALA", SecStrType::other, phi - h, psi, options).z) /
+		           (2 * h);
+		float d2 = (ramachandranZScore("ALA", SecStrType::other, phi, psi + h, options).z -
+					   ramachandranZScore("ALA", SecStrType::other, phi, psi - h, options).z) /
+		           (2 * h);
+
+		BOOST_TEST(std::abs(g.d1 - d1) < 1e-3f);
+		BOOST_TEST(std::abs(g.d2 - d2) < 1e-3f);
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(dihedrals, Fixture1cbs, *utf::tolerance(0.001f))
+{
+	for (auto &poly : structure.polymers())
+	{
+		PolymerDihedrals dihedrals(poly);
+
+		for (size_t i = 0; i < poly.size(); ++i)
+		{
+			auto &res = poly[i];
+
+			BOOST_TEST(dihedrals.phi[i] == res.phi());
+			BOOST_TEST(dihedrals.psi[i] == res.psi());
+			BOOST_TEST(dihedrals.chiCount[i] == res.nr_of_chis());
+			BOOST_TEST(dihedrals.isCis(i) == res.is_cis());
+
+			if (res.nr_of_chis() > 0)
+				BOOST_TEST(dihedrals.chi1[i] == res.chi(0));
+			if (res.nr_of_chis() > 1)
+				BOOST_TEST(dihedrals.chi2[i] == res.chi(1));
+		}
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(candidates, Fixture1cbs, *utf::tolerance(0.0001))
+{
+	CandidateScorer scorer(structure);
+
+	std::vector<cif::point> coordinates;
+	for (auto &atom : structure.atoms())
+		coordinates.push_back(atom.get_location());
+
+	for (auto &candidate : { scorer.score(coordinates), scorer.score(structure) })
+	{
+		BOOST_TEST(candidate.ramachandranZ == full.ramachandranZ);
+		BOOST_TEST(candidate.ramachandranJackknifeSD == full.ramachandranJackknifeSD);
+		BOOST_TEST(candidate.torsionZ == full.torsionZ);
+		BOOST_TEST(candidate.torsionJackknifeSD == full.torsionJackknifeSD);
+		BOOST_TEST(candidate.residues.size() == full.residues.size());
+	}
+
+	coordinates.pop_back();
+	BOOST_CHECK_THROW(scorer.score(coordinates), std::runtime_error);
+}
+
+BOOST_FIXTURE_TEST_CASE(candidates_bicubic, Fixture1cbs, *utf::tolerance(0.0001))
+{
+	TortoizeOptions options;
+	options.interpolation = Interpolation::bicubic;
+	options.gradients = true;
+
+	auto full = calculateScores(structure, options);
+	auto candidate = CandidateScorer(structure, options).score(structure);
+
+	BOOST_TEST(candidate.ramachandranZ == full.ramachandranZ);
+	BOOST_TEST(candidate.torsionZ == full.torsionZ);
+	BOOST_TEST_REQUIRE(candidate.residues.size() == full.residues.size());
+
+	for (size_t i = 0; i < full.residues.size(); ++i)
+	{
+		auto &a = candidate.residues[i];
+		auto &b = full.residues[i];
+
+		BOOST_TEST(a.seqID == b.seqID);
+		BOOST_TEST(a.ramachandranZ == b.ramachandranZ);
+		BOOST_TEST(a.ramachandranGradient[0] == b.ramachandranGradient[0]);
+		BOOST_TEST(a.ramachandranGradient[1] == b.ramachandranGradient[1]);
+		BOOST_TEST(a.torsionZ.has_value() == b.torsionZ.has_value());
+		if (a.torsionZ and b.torsionZ)
+		{
+			BOOST_TEST(*a.torsionZ == *b.torsionZ);
+			BOOST_TEST(a.torsionGradient[0] == b.torsionGradient[0]);
+			BOOST_TEST(a.torsionGradient[1] == b.torsionGradient[1]);
+		}
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(local_zscores, Fixture1cbs, *utf::tolerance(0.0001))
+{
+	TortoizeOptions options;
+	options.windows = { 9, 10000 };
+
+	auto model = calculateScores(structure, options);
+
+	BOOST_TEST(not model.residues.empty());
+
+	for (auto &residue : model.residues)
+	{
+		BOOST_TEST_REQUIRE(residue.local.size() == 2);
+		BOOST_TEST(residue.local[0].window == 9);
+
+		// 1cbs has a single chain, a window covering all of it equals the model score
+		BOOST_TEST(residue.local[1].ramachandranZ == model.ramachandranZ);
+		BOOST_TEST(residue.local[1].torsionZ.value_or(0) == model.torsionZ);
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(groups, Fixture1cbs, *utf::tolerance(0.0001))
+{
+	// 1cbs has a single protein chain, the chain and entity scores equal the model score
+	BOOST_TEST_REQUIRE(full.chains.size() == 1);
+	BOOST_TEST_REQUIRE(full.entities.size() == 1);
+
+	for (auto &group : { full.chains.begin()->second, full.entities.begin()->second })
+	{
+		BOOST_TEST(group.ramachandranCount == full.residues.size());
+		BOOST_TEST(group.ramachandranZ == full.ramachandranZ);
+		BOOST_TEST(group.ramachandranJackknifeSD == full.ramachandranJackknifeSD);
+		BOOST_TEST(group.torsionZ == full.torsionZ);
+		BOOST_TEST(group.torsionJackknifeSD == full.torsionJackknifeSD);
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(selection, Fixture1cbs, *utf::tolerance(0.0001))
+{
+	auto selection = parseSelection("A,B:10-50,C:7");
+
+	BOOST_TEST_REQUIRE(selection.size() == 3);
+	BOOST_TEST(selection[0].contains("A", 1000));
+	BOOST_TEST(selection[1].contains("B", 10));
+	BOOST_TEST(not selection[1].contains("B", 51));
+	BOOST_TEST(selection[2].contains("C", 7));
+	BOOST_TEST(not selection[2].contains("C", 8));
+
+	BOOST_CHECK_THROW(parseSelection("B:50-10"), std::invalid_argument);
+	BOOST_CHECK_THROW(parseSelection("B:x"), std::invalid_argument);
+
+	TortoizeOptions options;
+	options.selection = parseSelection("A:20-60");
+
+	auto part = calculateScores(file, options).front();
+
+	BOOST_TEST(not part.residues.empty());
+
+	// The context around the selection leaves the residue scores unchanged
+	for (auto &residue : part.residues)
+	{
+		BOOST_TEST(residue.seqID >= 20);
+		BOOST_TEST(residue.seqID <= 60);
+
+		auto i = std::find_if(full.residues.begin(), full.residues.end(), [&residue](const ResidueScore &r)
+			{ return r.asymID == residue.asymID and r.seqID == residue.seqID; });
+
+		BOOST_TEST_REQUIRE((i != full.residues.end()));
+		BOOST_TEST(residue.ramachandranZ == i->ramachandranZ);
+	}
+}
+
+// --------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(only, Fixture1cbs, *utf::tolerance(0.0001))
+{
+	TortoizeOptions options;
+
+	options.only = parseScoreType("ramachandran");
+	auto rama = calculateScores(structure, options);
+
+	BOOST_TEST(rama.ramachandranZ == full.ramachandranZ);
+	BOOST_TEST(rama.ramachandranJackknifeSD == full.ramachandranJackknifeSD);
+	BOOST_TEST(std::isnan(rama.torsionZ));
+	BOOST_TEST(rama.residues.size() == full.residues.size());
+
+	options.only = parseScoreType("torsion");
+	auto tors = calculateScores(structure, options);
+
+	BOOST_TEST(tors.torsionZ == full.torsionZ);
+	BOOST_TEST(tors.torsionJackknifeSD == full.torsionJackknifeSD);
+	BOOST_TEST(std::isnan(tors.ramachandranZ));
+
+	for (auto &residue : tors.residues)
+		BOOST_TEST(residue.torsionZ.has_value());
+
+	BOOST_CHECK_THROW(parseScoreType("phi"), std::invalid_argument);
+}
+
+// --------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(bin_spacing, Fixture1cbs)
+{
+	TortoizeOptions options;
+	options.tables = loadDataTable(1);
+
+	auto fine = calculateScores(structure, options);
+
+	// The finer grid follows the bicubic surface, close to the default
+	BOOST_TEST(std::abs(fine.ramachandranZ - full.ramachandranZ) < 0.25);
+	BOOST_TEST(std::abs(fine.torsionZ - full.torsionZ) < 0.25);
+
+	BOOST_CHECK_THROW(loadDataTable(7), std::invalid_argument);
+
+	// Coarser than the stored 3 degree grids
+	BOOST_CHECK_THROW(loadDataTable(10), std::invalid_argument);
+}
+
+// --------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(table_statistics)
+{
+	// The mean and sd stored with the distributed tables are those of the
+	// count of the bin of each observation, the trainer uses the same
+	auto &tbl = DataTable::instance();
+
+	auto check = [](const Data &d)
+	{
+		auto [n, mean, sd] = d.statistics();
+		auto [storedMean, storedSD] = d.meanAndSD();
+
+		BOOST_TEST(n > 0);
+		BOOST_TEST(std::abs(mean - storedMean) <= 1e-4 * storedMean);
+		BOOST_TEST(std::abs(sd - storedSD) <= 1e-4 * storedSD);
+	};
+
+	for (auto &aa : cif::compound_factory::kAAMap)
+	{
+		for (auto ss : { SecStrType::helix, SecStrType::strand, SecStrType::other })
+		{
+			check(tbl.loadRamachandranData(aa.first, ss));
+			if (aa.first != "ALA" and aa.first != "GLY")
+				check(tbl.loadTorsionData(aa.first, ss));
+		}
+	}
+
+	check(tbl.loadRamachandranData("PRO", SecStrType::cis));
+	for (auto aa : { "ALA", "GLY", "ILE" })
+		check(tbl.loadRamachandranData(aa, SecStrType::prepro));
+}
+
+BOOST_AUTO_TEST_CASE(training)
+{
+	auto dir = fs::temp_directory_path() / "tortoize-training-test";
+	fs::remove_all(dir);
+	fs::create_directories(dir / "in");
+
+	// The calibration needs at least two structures with a different
+	// average z-score, the second is 1cbs with all atoms moved a bit
+	fs::copy_file(gTestDir / "1cbs.cif.gz", dir / "in" / "a.cif.gz");
+
+	{
+		cif::file file = cif::pdb::read(gTestDir / "1cbs.cif.gz");
+		cif::mm::structure structure(file);
+
+		std::mt19937 rng(42);
+		std::uniform_real_distribution<float> shift(-0.3f, 0.3f);
+
+		for (auto &atom : structure.atoms())
+		{
+			auto pt = atom.get_location();
+			atom.set_location({ pt.m_x + shift(rng), pt.m_y + shift(rng), pt.m_z + shift(rng) });
+		}
+
+		file.save(dir / "in" / "b.cif");
+	}
+
+	// A fixed secondary structure, so the classification of the residues
+	// does not depend on DSSP for the moved structure
+	auto secstr = [](const cif::mm::structure &)
+	{
+		return [](const cif::mm::residue &) -> std::optional<SecStrType>
+		{ return SecStrType::other; };
+	};
+
+	TrainingOptions options;
+	options.threads = 2;
+	options.secondaryStructure = secstr;
+
+	trainDataFiles(dir / "in", dir, options);
+
+	for (auto name : { "rama-data.bin", "torsion-data.bin", "zscores_proteins.txt" })
+		BOOST_TEST(fs::file_size(dir / name) > 0);
+
+	auto trained = loadDataTable(dir);
+
+	// Count the observations per table by hand, from the classification
+	// of the residues when scoring both structures with the new tables
+	TortoizeOptions scoreOptions;
+	scoreOptions.tables = trained;
+	scoreOptions.secondaryStructure = secstr;
+
+	std::map<const Data *, size_t> expected;
+	ModelScore result;
+
+	for (auto name : { "a.cif.gz", "b.cif" })
+	{
+		cif::file file = cif::pdb::read(dir / "in" / name);
+		cif::mm::structure structure(file);
+
+		result = calculateScores(structure, scoreOptions);
+
+		for (auto &residue : result.residues)
+		{
+			expected[&trained->loadRamachandranData(residue.compoundID, residue.ramachandranSS)] += 1;
+			if (residue.torsionZ)
+				expected[&trained->loadTorsionData(residue.compoundID, residue.torsionSS)] += 1;
+		}
+	}
+
+	BOOST_TEST(not expected.empty());
+
+	for (auto [d, count] : expected)
+	{
+		auto [n, mean, sd] = d->statistics();
+		auto [storedMean, storedSD] = d->meanAndSD();
+
+		BOOST_TEST(n == count);
+		BOOST_TEST(std::abs(mean - storedMean) <= 1e-4 * storedMean);
+
+		// a table where all observations share a bin gets an sd of 1
+		BOOST_TEST(std::abs((sd > 0 ? sd : 1) - storedSD) <= 1e-4 * storedSD);
+	}
+
+	// The last result is that of the moved structure, scored with tables
+	// containing it
+	BOOST_TEST(std::isfinite(result.ramachandranZ));
+	BOOST_TEST(std::isfinite(result.torsionZ));
+	BOOST_TEST(std::abs(result.ramachandranZ) < 10);
+	BOOST_TEST(std::abs(result.torsionZ) < 10);
+
+	for (auto &residue : result.residues)
+		BOOST_TEST(std::isfinite(residue.ramachandranZ));
+
+	// Identical structures cannot be used for the calibration
+	fs::remove(dir / "in" / "b.cif");
+	fs::copy_file(gTestDir / "1cbs.cif.gz", dir / "in" / "b.cif.gz");
+	BOOST_CHECK_THROW(trainDataFiles(dir / "in", dir, options), std::runtime_error);
+
+	fs::remove_all(dir);
+}